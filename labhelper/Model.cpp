@@ -1,5 +1,8 @@
 #include "Model.h"
 #include "labhelper.h"
+#include "objparser.h"
+#include "mappedfile.h"
+#include "perf.h"
 #include <iostream>
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include <tiny_obj_loader.h>
@@ -8,8 +11,12 @@
 #include <sstream>
 #include <iomanip>
 #include <GL/glew.h>
+#include <glm/gtc/packing.hpp>
 #include <stb_image.h>
-#include <map>
+#include <unordered_map>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
 
 namespace labhelper
 {
@@ -61,11 +68,32 @@ bool Texture::load(const std::string& _directory, const std::string& _filename,
 	return true;
 }
 
+uint32_t Material::textureMask() const
+{
+	return (m_color_texture.valid ? uint32_t(COLOR_TEXTURE_BIT) : 0u)
+	       | (m_reflectivity_texture.valid ? uint32_t(REFLECTIVITY_TEXTURE_BIT) : 0u)
+	       | (m_shininess_texture.valid ? uint32_t(SHININESS_TEXTURE_BIT) : 0u)
+	       | (m_metalness_texture.valid ? uint32_t(METALNESS_TEXTURE_BIT) : 0u)
+	       | (m_fresnel_texture.valid ? uint32_t(FRESNEL_TEXTURE_BIT) : 0u)
+	       | (m_emission_texture.valid ? uint32_t(EMISSION_TEXTURE_BIT) : 0u);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Destructor
 ///////////////////////////////////////////////////////////////////////////
 Model::~Model()
 {
+	glDeleteVertexArrays(1, &m_vaob);
+	glDeleteBuffers(1, &m_positions_bo);
+	for(auto& draw_commands : m_draw_commands_bos)
+	{
+		glDeleteBuffers(1, &draw_commands.second);
+	}
+	if(m_instance_of != nullptr)
+	{
+		// Everything else belongs to the model this is an instance of
+		return;
+	}
 	for(auto& material : m_materials)
 	{
 		if(material.m_color_texture.valid)
@@ -81,51 +109,104 @@ Model::~Model()
 		if(material.m_emission_texture.valid)
 			glDeleteTextures(1, &material.m_emission_texture.gl_id);
 	}
-	glDeleteBuffers(1, &m_positions_bo);
 	glDeleteBuffers(1, &m_normals_bo);
 	glDeleteBuffers(1, &m_texture_coordinates_bo);
+	glDeleteBuffers(1, &m_static_attributes_bo);
+	glDeleteBuffers(1, &m_materials_bo);
 	glDeleteBuffers(1, &m_indices_bo);
+	glDeleteBuffers(1, &m_vertex_face_offsets_bo);
+	glDeleteBuffers(1, &m_vertex_faces_bo);
+	glDeleteBuffers(1, &m_vertex_vertex_offsets_bo);
+	glDeleteBuffers(1, &m_vertex_vertices_bo);
+	glDeleteBuffers(1, &m_welded_position_indices_bo);
 }
 
-Model* loadModelFromOBJ(std::string path)
+///////////////////////////////////////////////////////////////////////
+// A vertex as it is uploaded, the key when finding the unique vertices
+///////////////////////////////////////////////////////////////////////
+struct Vertex
 {
-	///////////////////////////////////////////////////////////////////////
-	// Separate filename into directory, base filename and extension
-	// NOTE: This can be made a LOT simpler as soon as compilers properly
-	//		 support std::filesystem (C++17)
-	///////////////////////////////////////////////////////////////////////
-	size_t separator = path.find_last_of("\\/");
-	std::string filename, extension, directory;
-	if(separator != std::string::npos)
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 texcoord;
+};
+
+///////////////////////////////////////////////////////////////////////
+// Hash set of vertices with open addressing (linear probing), which
+// numbers the vertices in the order they are first inserted. Vertices
+// are compared bit-exactly. It is sized for a maximum number of
+// vertices up front and never grows.
+///////////////////////////////////////////////////////////////////////
+class VertexHashTable
+{
+public:
+	explicit VertexHashTable(size_t max_vertices)
 	{
-		filename = path.substr(separator + 1, path.size() - separator - 1);
-		directory = path.substr(0, separator + 1);
+		size_t capacity = 16;
+		while(capacity < 2 * max_vertices)
+		{
+			capacity *= 2;
+		}
+		m_slots.assign(capacity, s_empty);
+		m_vertices.reserve(max_vertices);
 	}
-	else
+
+	// Returns the index of the vertex, after adding it if it was new
+	uint32_t findOrInsert(const Vertex& vertex, bool& inserted)
 	{
-		filename = path;
-		directory = "./";
+		size_t mask = m_slots.size() - 1;
+		for(size_t slot = hash(vertex) & mask;; slot = (slot + 1) & mask)
+		{
+			uint32_t index = m_slots[slot];
+			if(index == s_empty)
+			{
+				index = uint32_t(m_vertices.size());
+				m_slots[slot] = index;
+				m_vertices.push_back(vertex);
+				inserted = true;
+				return index;
+			}
+			if(memcmp(&m_vertices[index], &vertex, sizeof(Vertex)) == 0)
+			{
+				inserted = false;
+				return index;
+			}
+		}
 	}
-	separator = filename.find_last_of(".");
-	if(separator == std::string::npos)
+
+private:
+	static constexpr uint32_t s_empty = ~0u;
+	std::vector<uint32_t> m_slots;
+	std::vector<Vertex> m_vertices;
+
+	static size_t hash(const Vertex& vertex)
 	{
-		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
-		exit(1);
+		static_assert(sizeof(Vertex) == 8 * sizeof(uint32_t), "Vertex must not have padding");
+		uint32_t words[8];
+		memcpy(words, &vertex, sizeof(words));
+		uint64_t h = 14695981039346656037ull; // FNV-1a over the words
+		for(uint32_t word : words)
+		{
+			h = (h ^ word) * 1099511628211ull;
+		}
+		return size_t(h ^ (h >> 32));
 	}
-	extension = filename.substr(separator, filename.size() - separator);
-	filename = filename.substr(0, separator);
+};
 
+///////////////////////////////////////////////////////////////////////
+// Parse the OBJ file and create the unique vertices, but don't upload
+///////////////////////////////////////////////////////////////////////
+static Model* buildModelFromOBJ(const std::string& path, const std::string& directory)
+{
 	///////////////////////////////////////////////////////////////////////
-	// Parse the OBJ file using tinyobj
+	// Parse the OBJ file into tinyobj's structures, on all threads
 	///////////////////////////////////////////////////////////////////////
-	std::cout << "Loading " << path << "..." << std::flush;
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
 	std::string err;
-	// Expect '.mtl' file in the same directory and triangulate meshes
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-	                            (directory + filename + extension).c_str(), directory.c_str(), true);
+	// Expect '.mtl' file in the same directory, meshes are triangulated
+	bool ret = parseOBJ(&attrib, &shapes, &materials, &err, path, directory);
 	if(!err.empty())
 	{ // `err` may contain warning message.
 		std::cerr << err << std::endl;
@@ -135,8 +216,6 @@ Model* loadModelFromOBJ(std::string path)
 		exit(1);
 	}
 	Model* model = new Model;
-	model->m_name = filename;
-	model->m_filename = path;
 
 	///////////////////////////////////////////////////////////////////////
 	// Transform all materials into our datastructure
@@ -184,20 +263,14 @@ Model* loadModelFromOBJ(std::string path)
 	// normal and texture coordinate. We will now create unique vertices
 	// and generate indices for indexed rendering.
 	///////////////////////////////////////////////////////////////////////
-	// We'll use a map to store unique vertices to avoid duplicates
-	struct Vertex {
-		glm::vec3 position;
-		glm::vec3 normal;
-		glm::vec2 texcoord;
-
-		bool operator<(const Vertex& other) const {
-			if (position != other.position) return position.x < other.position.x || (position.x == other.position.x && (position.y < other.position.y || (position.y == other.position.y && position.z < other.position.z)));
-			if (normal != other.normal) return normal.x < other.normal.x || (normal.x == other.normal.x && (normal.y < other.normal.y || (normal.y == other.normal.y && normal.z < other.normal.z)));
-			return texcoord.x < other.texcoord.x || (texcoord.x == other.texcoord.x && texcoord.y < other.texcoord.y);
-		}
-	};
-	std::map<Vertex, uint32_t> unique_vertices;
-	uint32_t current_vertex_index = 0;
+	// We'll use a hash table to store unique vertices to avoid duplicates.
+	// There can't be more unique vertices than corners, so it never grows.
+	size_t number_of_corners = 0;
+	for(const auto& shape : shapes)
+	{
+		number_of_corners += shape.mesh.indices.size();
+	}
+	VertexHashTable unique_vertices(number_of_corners);
 
 	///////////////////////////////////////////////////////////////////////
 	// For each vertex _position_ auto generate a normal that will be used
@@ -236,336 +309,1511 @@ Model* loadModelFromOBJ(std::string path)
 	// Now we will turn all shapes into Meshes. A shape that has several
 	// materials will be split into several meshes with unique names
 	///////////////////////////////////////////////////////////////////////
+	// For each material, its bucket in the current shape or -1. Only the
+	// entries of the shape's materials are reset after each shape.
+	std::vector<int> material_buckets(materials.size(), -1);
+	std::vector<int> bucket_materials;
+	std::vector<uint32_t> bucket_starts;
+	std::vector<uint32_t> sorted_faces;
 	uint32_t indices_so_far = 0;
 	for(const auto& shape : shapes)
 	{
 		///////////////////////////////////////////////////////////////////
 		// The shapes in an OBJ file may several different materials.
-		// If so, we will split the shape into one Mesh per Material
+		// If so, we will split the shape into one Mesh per Material, in
+		// the order the materials first appear. The faces are grouped by
+		// material with a counting sort, which keeps them in file order
+		// within each material. Faces without a material are skipped.
 		///////////////////////////////////////////////////////////////////
-		int next_material_index = shape.mesh.material_ids[0];
-		int next_material_starting_face = 0;
-		std::vector<bool> finished_materials(materials.size(), false);
-		int number_of_materials_in_shape = 0;
-		while(next_material_index != -1)
-		{
-			int current_material_index = next_material_index;
-			int current_material_starting_face = next_material_starting_face;
-			next_material_index = -1;
-			next_material_starting_face = -1;
+		const uint32_t number_of_faces = uint32_t(shape.mesh.indices.size() / 3);
+		bucket_materials.clear();
+		bucket_starts.clear();
+		for(uint32_t i = 0; i < number_of_faces; i++)
+		{
+			int material = shape.mesh.material_ids[i];
+			if(material < 0)
+				continue;
+			if(material_buckets[material] == -1)
+			{
+				material_buckets[material] = int(bucket_materials.size());
+				bucket_materials.push_back(material);
+				bucket_starts.push_back(0);
+			}
+			bucket_starts[material_buckets[material]]++;
+		}
+		uint32_t sum = 0;
+		for(auto& start : bucket_starts)
+		{
+			uint32_t count = start;
+			start = sum;
+			sum += count;
+		}
+		bucket_starts.push_back(sum);
+		sorted_faces.resize(sum);
+		for(uint32_t i = 0; i < number_of_faces; i++)
+		{
+			int material = shape.mesh.material_ids[i];
+			if(material >= 0)
+				sorted_faces[bucket_starts[material_buckets[material]]++] = i;
+		}
+		// The starts were advanced to the ends of the buckets
+		bucket_starts.pop_back();
+		bucket_starts.insert(bucket_starts.begin(), 0);
+
+		for(size_t bucket = 0; bucket < bucket_materials.size(); bucket++)
+		{
+			int current_material_index = bucket_materials[bucket];
+			material_buckets[current_material_index] = -1;
 			// Process a new Mesh with a unique material
 			Mesh mesh;
 			mesh.m_name = shape.name + "_" + materials[current_material_index].name;
 			mesh.m_material_idx = current_material_index;
 			mesh.m_start_index = indices_so_far;
-			number_of_materials_in_shape += 1;
 
-			uint64_t number_of_faces = shape.mesh.indices.size() / 3;
-			for(int i = current_material_starting_face; i < number_of_faces; i++)
+			for(uint32_t f = bucket_starts[bucket]; f < bucket_starts[bucket + 1]; f++)
 			{
-				if(shape.mesh.material_ids[i] != current_material_index)
+				uint32_t i = sorted_faces[f];
+				///////////////////////////////////////////////////////////
+				// Now we generate the unique vertices and indices
+				///////////////////////////////////////////////////////////
+				for(int j = 0; j < 3; j++)
 				{
-					if(next_material_index >= 0)
-						continue;
-					else if(finished_materials[shape.mesh.material_ids[i]])
-						continue;
+					Vertex vertex;
+					vertex.position = glm::vec3(attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 0],
+					                            attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 1],
+					                            attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 2]);
+					if(shape.mesh.indices[i * 3 + j].normal_index == -1)
+					{
+						// No normal, use the autogenerated
+						vertex.normal = glm::vec3(auto_normals[shape.mesh.indices[i * 3 + j].vertex_index]);
+					}
 					else
-					{ // Found a new material that we have not processed.
-						next_material_index = shape.mesh.material_ids[i];
-						next_material_starting_face = i;
+					{
+						vertex.normal = glm::vec3(attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 0],
+						                          attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 1],
+						                          attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 2]);
 					}
-				}
-				else
-				{
-					///////////////////////////////////////////////////////
-					// Now we generate the unique vertices and indices
-					///////////////////////////////////////////////////////
-					for(int j = 0; j < 3; j++)
+					if(shape.mesh.indices[i * 3 + j].texcoord_index == -1)
+					{
+						// No UV coordinates. Use null.
+						vertex.texcoord = glm::vec2(0.0f);
+					}
+					else
+					{
+						vertex.texcoord = glm::vec2(attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 0],
+						                            attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 1]);
+					}
+
+					// Check if this vertex already exists
+					bool inserted;
+					uint32_t index = unique_vertices.findOrInsert(vertex, inserted);
+					if(inserted)
 					{
-						Vertex vertex;
-						vertex.position = glm::vec3(attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 0],
-						                            attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 1],
-						                            attrib.vertices[shape.mesh.indices[i * 3 + j].vertex_index * 3 + 2]);
-						if(shape.mesh.indices[i * 3 + j].normal_index == -1)
-						{
-							// No normal, use the autogenerated
-							vertex.normal = glm::vec3(auto_normals[shape.mesh.indices[i * 3 + j].vertex_index]);
-						}
-						else
-						{
-							vertex.normal = glm::vec3(attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 0],
-							                          attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 1],
-							                          attrib.normals[shape.mesh.indices[i * 3 + j].normal_index * 3 + 2]);
-						}
-						if(shape.mesh.indices[i * 3 + j].texcoord_index == -1)
-						{
-							// No UV coordinates. Use null.
-							vertex.texcoord = glm::vec2(0.0f);
-						}
-						else
-						{
-							vertex.texcoord = glm::vec2(attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 0],
-							                            attrib.texcoords[shape.mesh.indices[i * 3 + j].texcoord_index * 2 + 1]);
-						}
-
-						// Check if this vertex already exists
-						if (unique_vertices.count(vertex) == 0) {
-							unique_vertices[vertex] = current_vertex_index;
-							model->m_positions.push_back(vertex.position);
-							model->m_normals.push_back(vertex.normal);
-							model->m_texture_coordinates.push_back(vertex.texcoord);
-							current_vertex_index++;
-						}
-						model->m_indices.push_back(unique_vertices[vertex]);
+						model->m_positions.push_back(vertex.position);
+						model->m_normals.push_back(vertex.normal);
+						model->m_texture_coordinates.push_back(vertex.texcoord);
 					}
-					indices_so_far += 3; // Increment by 3 for indices
+					model->m_indices.push_back(index);
 				}
+				indices_so_far += 3; // Increment by 3 for indices
 			}
 			///////////////////////////////////////////////////////////////
 			// Finalize and push this mesh to the list
 			///////////////////////////////////////////////////////////////
 			mesh.m_number_of_indices = indices_so_far - mesh.m_start_index; // Store number of indices
 			model->m_meshes.push_back(mesh);
-			finished_materials[current_material_index] = true;
 		}
-		if(number_of_materials_in_shape == 1)
+		if(bucket_materials.size() == 1)
 		{
 			model->m_meshes.back().m_name = shape.name;
 		}
 	}
 
-	///////////////////////////////////////////////////////////////////////
-	// Upload to GPU
-	///////////////////////////////////////////////////////////////////////
-	glGenVertexArrays(1, &model->m_vaob);
-	glBindVertexArray(model->m_vaob);
-	glGenBuffers(1, &model->m_positions_bo);
+	return model;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Octahedral encoding of a unit vector, decoded in shading.vert
+///////////////////////////////////////////////////////////////////////
+static uint32_t encodeOctahedral(glm::vec3 n)
+{
+	float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if(sum == 0.0f)
+	{
+		return glm::packSnorm2x16(glm::vec2(0.0f));
+	}
+	n /= sum;
+	glm::vec2 p(n.x, n.y);
+	if(n.z < 0.0f)
+	{
+		glm::vec2 sign(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+		p = (1.0f - glm::abs(glm::vec2(n.y, n.x))) * sign;
+	}
+	return glm::packSnorm2x16(p);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Point the attributes of the bound VAO to the model's buffers, in the
+// formats they were uploaded in
+///////////////////////////////////////////////////////////////////////
+static void setVertexAttributes(const Model* model)
+{
 	glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3), &model->m_positions[0].x,
-	             GL_STATIC_DRAW);
 	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
 	glEnableVertexAttribArray(0);
-	glGenBuffers(1, &model->m_normals_bo);
-	glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), &model->m_normals[0].x,
-	             GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+	// Either two separate buffers, or one with both attributes of a vertex
+	// after each other
+	GLsizei stride = 0;
+	size_t texture_coordinate_offset = 0;
+	if(model->m_static_attributes_bo != 0)
+	{
+		stride = GLsizei(model->normalSize() + model->textureCoordinateSize());
+		texture_coordinate_offset = model->normalSize();
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, model->m_static_attributes_bo != 0 ? model->m_static_attributes_bo : model->m_normals_bo);
+	if(model->m_compact_vertices)
+		glVertexAttribPointer(1, 2, GL_SHORT, true, stride, 0);
+	else
+		glVertexAttribPointer(1, 3, GL_FLOAT, false, stride, 0);
 	glEnableVertexAttribArray(1);
-	glGenBuffers(1, &model->m_texture_coordinates_bo);
-	glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
-	glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
-	             &model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
-	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+	if(model->m_static_attributes_bo == 0)
+		glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+	if(model->m_compact_vertices)
+		glVertexAttribPointer(2, 2, GL_HALF_FLOAT, false, stride, (const void*)texture_coordinate_offset);
+	else
+		glVertexAttribPointer(2, 2, GL_FLOAT, false, stride, (const void*)texture_coordinate_offset);
 	glEnableVertexAttribArray(2);
-
-	glGenBuffers(1, &model->m_indices_bo);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->m_indices.size() * sizeof(uint32_t), &model->m_indices[0], GL_STATIC_DRAW);
+}
 
-	glBindVertexArray( 0 );
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+///////////////////////////////////////////////////////////////////////
+// A material as the shaders see it, in std430 layout. Must match
+// struct Material in project/material.glsl.
+///////////////////////////////////////////////////////////////////////
+struct GpuMaterial
+{
+	glm::vec3 color;
+	float reflectivity;
+	float metalness;
+	float fresnel;
+	float shininess;
+	float emission;
+	uint32_t texture_mask;
+	uint32_t padding[3];
+};
+static_assert(sizeof(GpuMaterial) == 48, "GpuMaterial must match the std430 layout of Material");
 
-	std::cout << "done.\n";
-	return model;
+static void uploadMaterials(Model* model)
+{
+	std::vector<GpuMaterial> materials(std::max<size_t>(model->m_materials.size(), 1));
+	for(size_t i = 0; i < model->m_materials.size(); i++)
+	{
+		const Material& material = model->m_materials[i];
+		GpuMaterial& gpu_material = materials[i];
+		gpu_material.color = material.m_color;
+		gpu_material.reflectivity = material.m_reflectivity;
+		gpu_material.metalness = material.m_metalness;
+		gpu_material.fresnel = material.m_fresnel;
+		gpu_material.shininess = material.m_shininess;
+		gpu_material.emission = material.m_emission;
+		gpu_material.texture_mask = material.textureMask();
+	}
+	glGenBuffers(1, &model->m_materials_bo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, model->m_materials_bo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(GpuMaterial), materials.data(),
+	             GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-void saveModelToOBJ(Model* model, std::string path)
+///////////////////////////////////////////////////////////////////////
+// The draw commands for glMultiDrawElementsIndirect, one per mesh
+///////////////////////////////////////////////////////////////////////
+struct DrawElementsIndirectCommand
 {
-	///////////////////////////////////////////////////////////////////////
-	// Separate filename into directory, base filename and extension
-	// NOTE: This can be made a LOT simpler as soon as compilers properly
-	//		 support std::filesystem (C++17)
-	///////////////////////////////////////////////////////////////////////
-	size_t separator = path.find_last_of("\\/");
-	std::string filename, extension, directory;
-	if(separator != std::string::npos)
+	uint32_t count;
+	uint32_t instance_count;
+	uint32_t first_index;
+	int32_t base_vertex;
+	uint32_t base_instance;
+};
+
+void prepareDrawCommands(Model* model, int numInstances)
+{
+	if(model->m_draw_commands_bos.count(numInstances) != 0)
 	{
-		filename = path.substr(separator + 1, path.size() - separator - 1);
-		directory = path.substr(0, separator + 1);
+		return;
 	}
-	else
+	std::vector<DrawElementsIndirectCommand> commands(model->m_meshes.size());
+	for(size_t i = 0; i < model->m_meshes.size(); i++)
 	{
-		filename = path;
-		directory = "./";
+		const Mesh& mesh = model->m_meshes[i];
+		commands[i].count = mesh.m_number_of_indices;
+		commands[i].instance_count = uint32_t(numInstances);
+		commands[i].first_index = mesh.m_start_index;
+		commands[i].base_vertex = 0;
+		// The shaders find the material through gl_BaseInstance
+		commands[i].base_instance = mesh.m_material_idx;
 	}
-	separator = filename.find_last_of(".");
-	if(separator == std::string::npos)
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+	GLsizeiptr size = commands.size() * sizeof(DrawElementsIndirectCommand);
+	if(GLEW_ARB_buffer_storage)
 	{
-		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
-		exit(1);
+		glBufferStorage(GL_DRAW_INDIRECT_BUFFER, size, commands.data(), 0);
 	}
-	extension = filename.substr(separator, filename.size() - separator);
-	filename = filename.substr(0, separator);
-
-	///////////////////////////////////////////////////////////////////////
-	// Save Materials
-	///////////////////////////////////////////////////////////////////////
-	std::ofstream mat_file(directory + filename + ".mtl");
-	if(!mat_file.is_open())
+	else
 	{
-		std::cout << "Could not open file " << filename << " for writing.\n";
-		return;
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, size, commands.data(), GL_STATIC_DRAW);
 	}
-	mat_file << "# Exported by Chalmers Graphics Group\n";
-	for(auto mat : model->m_materials)
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	model->m_draw_commands_bos[numInstances] = buffer;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Create the VAO and buffers of the model, from the model's vectors or
+// straight from a mapped cache file. In the compact format the normals
+// and texture coordinates are converted first, and the indices if they
+// fit in 16 bits. The normals and texture coordinates are optionally
+// interleaved in one immutable buffer.
+///////////////////////////////////////////////////////////////////////
+static void uploadModel(Model* model, const glm::vec3* positions, const glm::vec3* normals,
+                        const glm::vec2* texture_coordinates, size_t num_vertices, const uint32_t* indices,
+                        size_t num_indices, const ModelLoadOptions& options)
+{
+	const bool compact = options.compact_vertices;
+	model->m_compact_vertices = compact;
+	model->m_index_size = compact && num_vertices < 0xFFFF ? sizeof(uint16_t) : sizeof(uint32_t);
+
+	uploadMaterials(model);
+	prepareDrawCommands(model, 1);
+	model->m_has_material_textures = false;
+	for(const Material& material : model->m_materials)
 	{
-		mat_file << "newmtl " << mat.m_name << "\n";
-		mat_file << "Kd " << mat.m_color.x << " " << mat.m_color.y << " " << mat.m_color.z << "\n";
-		mat_file << "Ks " << mat.m_reflectivity << " " << mat.m_reflectivity << " " << mat.m_reflectivity
-		         << "\n";
-		mat_file << "Pm " << mat.m_metalness << "\n";
-		mat_file << "Ps " << mat.m_fresnel << "\n";
-		mat_file << "Pr " << mat.m_shininess << "\n";
-		mat_file << "Ke " << mat.m_emission << " " << mat.m_emission << " " << mat.m_emission << "\n";
-		mat_file << "Tf " << mat.m_transparency << " " << mat.m_transparency << " " << mat.m_transparency
-		         << "\n";
-		if(mat.m_color_texture.valid)
-			mat_file << "map_Kd " << mat.m_color_texture.filename << "\n";
-		if(mat.m_reflectivity_texture.valid)
-			mat_file << "map_Ks " << mat.m_reflectivity_texture.filename << "\n";
-		if(mat.m_metalness_texture.valid)
-			mat_file << "map_Pm " << mat.m_metalness_texture.filename << "\n";
-		if(mat.m_fresnel_texture.valid)
-			mat_file << "map_Ps " << mat.m_fresnel_texture.filename << "\n";
-		if(mat.m_shininess_texture.valid)
-			mat_file << "map_Pr " << mat.m_shininess_texture.filename << "\n";
-		if(mat.m_emission_texture.valid)
-			mat_file << "map_Ke " << mat.m_emission_texture.filename << "\n";
+		model->m_has_material_textures |= material.textureMask() != 0;
 	}
-	mat_file.close();
 
-	///////////////////////////////////////////////////////////////////////
-	// Save geometry
-	///////////////////////////////////////////////////////////////////////
-	std::ofstream obj_file(directory + filename + ".obj");
-	if(!obj_file.is_open())
+	model->m_dynamic_positions = options.dynamic_positions;
+	glGenBuffers(1, &model->m_positions_bo);
+	glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+	glBufferData(GL_ARRAY_BUFFER, num_vertices * sizeof(glm::vec3), positions,
+	             model->m_dynamic_positions ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+
+	// The normals and texture coordinates in the format they are uploaded in
+	const void* normal_data = normals;
+	const void* texture_coordinate_data = texture_coordinates;
+	std::vector<uint32_t> octahedral_normals, half_texture_coordinates;
+	if(compact)
 	{
-		std::cout << "Could not open file " << filename << " for writing.\n";
-		return;
+		octahedral_normals.resize(num_vertices);
+		half_texture_coordinates.resize(num_vertices);
+		for(size_t i = 0; i < num_vertices; i++)
+		{
+			octahedral_normals[i] = encodeOctahedral(normals[i]);
+			half_texture_coordinates[i] = glm::packHalf2x16(texture_coordinates[i]);
+		}
+		normal_data = octahedral_normals.data();
+		texture_coordinate_data = half_texture_coordinates.data();
 	}
-	obj_file << "# Exported by Chalmers Graphics Group\n";
-	obj_file << "mtllib " << filename << ".mtl\n";
+	const size_t normal_size = model->normalSize();
+	const size_t texture_coordinate_size = model->textureCoordinateSize();
 
-	// Output unique vertices first
-	for(const auto& pos : model->m_positions) {
-		obj_file << "v " << pos.x << " " << pos.y << " " << pos.z << "\n";
-	}
-	for(const auto& normal : model->m_normals) {
-		obj_file << "vn " << normal.x << " " << normal.y << " " << normal.z << "\n";
+	if(options.interleave_static_attributes)
+	{
+		const size_t stride = normal_size + texture_coordinate_size;
+		std::vector<uint8_t> interleaved(num_vertices * stride);
+		for(size_t i = 0; i < num_vertices; i++)
+		{
+			memcpy(&interleaved[i * stride], static_cast<const uint8_t*>(normal_data) + i * normal_size, normal_size);
+			memcpy(&interleaved[i * stride + normal_size],
+			       static_cast<const uint8_t*>(texture_coordinate_data) + i * texture_coordinate_size,
+			       texture_coordinate_size);
+		}
+		glGenBuffers(1, &model->m_static_attributes_bo);
+		glBindBuffer(GL_ARRAY_BUFFER, model->m_static_attributes_bo);
+		if(GLEW_ARB_buffer_storage)
+		{
+			// Immutable, which lets the driver place it optimally
+			glBufferStorage(GL_ARRAY_BUFFER, interleaved.size(), interleaved.data(), 0);
+		}
+		else
+		{
+			glBufferData(GL_ARRAY_BUFFER, interleaved.size(), interleaved.data(), GL_STATIC_DRAW);
+		}
 	}
-	for(const auto& texcoord : model->m_texture_coordinates) {
-		obj_file << "vt " << texcoord.x << " " << texcoord.y << "\n";
+	else
+	{
+		glGenBuffers(1, &model->m_normals_bo);
+		glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
+		glBufferData(GL_ARRAY_BUFFER, num_vertices * normal_size, normal_data, GL_STATIC_DRAW);
+		glGenBuffers(1, &model->m_texture_coordinates_bo);
+		glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+		glBufferData(GL_ARRAY_BUFFER, num_vertices * texture_coordinate_size, texture_coordinate_data,
+		             GL_STATIC_DRAW);
 	}
 
-	for(auto mesh : model->m_meshes)
+	glGenBuffers(1, &model->m_indices_bo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+	if(model->m_index_size == sizeof(uint16_t))
 	{
-		obj_file << "o " << mesh.m_name << "\n";
-		obj_file << "g " << mesh.m_name << "\n";
-		obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
+		// Padded to whole 32 bit words, so that shaders can read it as uints
+		std::vector<uint16_t> short_indices(indices, indices + num_indices);
+		short_indices.resize((num_indices + 1) & ~size_t(1), 0);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, short_indices.size() * sizeof(uint16_t), short_indices.data(),
+		             GL_STATIC_DRAW);
+	}
+	else
+	{
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(uint32_t), indices, GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-		// Output faces using indices
-		int number_of_faces = mesh.m_number_of_indices / 3;
-		for(int i = 0; i < number_of_faces; i++)
+	glGenVertexArrays(1, &model->m_vaob);
+	glBindVertexArray(model->m_vaob);
+	setVertexAttributes(model);
+
+	glBindVertexArray( 0 );
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Triangle and vertex reordering for the post-transform vertex cache,
+// overdraw and vertex fetch locality
+///////////////////////////////////////////////////////////////////////
+// The FIFO cache size assumed by the optimization and the statistics
+static const uint32_t vertex_cache_size = 16;
+
+// Average cache miss ratio (transformed vertices per triangle) of a FIFO
+// vertex cache. `stamps` has one entry per vertex.
+static float averageCacheMissRatio(const uint32_t* indices, size_t num_indices, std::vector<uint32_t>& stamps)
+{
+	const uint32_t not_cached = ~0u;
+	std::fill(stamps.begin(), stamps.end(), not_cached);
+	uint32_t misses = 0;
+	for(size_t i = 0; i < num_indices; i++)
+	{
+		uint32_t& stamp = stamps[indices[i]];
+		if(stamp == not_cached || misses - stamp > vertex_cache_size)
 		{
-			// OBJ indices are 1-based
-			uint32_t idx0 = model->m_indices[mesh.m_start_index + i * 3 + 0] + 1;
-			uint32_t idx1 = model->m_indices[mesh.m_start_index + i * 3 + 1] + 1;
-			uint32_t idx2 = model->m_indices[mesh.m_start_index + i * 3 + 2] + 1;
-			obj_file << "f " << idx0 << "/" << idx0 << "/" << idx0 << " " // pos/texcoord/normal
-			         << idx1 << "/" << idx1 << "/" << idx1 << " "
-			         << idx2 << "/" << idx2 << "/" << idx2 << "\n";
+			stamp = misses++;
 		}
 	}
-	obj_file.close();
+	return num_indices > 0 ? float(misses) / float(num_indices / 3) : 0.0f;
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Free model
+// Tipsify (Sander, Nehab and Barczak, "Fast Triangle Reordering for
+// Vertex Locality and Reduced Overdraw", 2007). Reorders the triangles
+// of `indices`, which use the vertices 0 .. num_vertices - 1, in place.
+// The triangles are fanned around one vertex at a time, moving on to the
+// neighbour that stays in the cache the longest. Where it has to jump to
+// a vertex outside the cache the order is split into clusters, whose
+// first triangles are returned in cluster_starts.
 ///////////////////////////////////////////////////////////////////////
-void freeModel(Model* model)
+static void tipsify(std::vector<uint32_t>& indices, uint32_t num_vertices, std::vector<uint32_t>& cluster_starts)
+{
+	const uint32_t num_triangles = uint32_t(indices.size() / 3);
+
+	// Vertex to triangle adjacency, and the number of live (not yet
+	// emitted) triangles around each vertex
+	std::vector<uint32_t> live(num_vertices, 0);
+	for(uint32_t index : indices)
+	{
+		live[index]++;
+	}
+	std::vector<uint32_t> offsets(num_vertices + 1, 0);
+	for(uint32_t v = 0; v < num_vertices; v++)
+	{
+		offsets[v + 1] = offsets[v] + live[v];
+	}
+	std::vector<uint32_t> triangles(indices.size());
+	std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+	for(uint32_t i = 0; i < uint32_t(indices.size()); i++)
+	{
+		triangles[fill[indices[i]]++] = i / 3;
+	}
+
+	std::vector<uint32_t> cache_time(num_vertices, 0);
+	std::vector<bool> emitted(num_triangles, false);
+	std::vector<uint32_t> dead_ends;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> output;
+	output.reserve(indices.size());
+	uint32_t time = vertex_cache_size + 1;
+	uint32_t scan = 0;
+	int fanning = num_vertices > 0 ? 0 : -1;
+	cluster_starts.assign(1, 0);
+	while(fanning >= 0)
+	{
+		candidates.clear();
+		for(uint32_t t = offsets[fanning]; t < offsets[fanning + 1]; t++)
+		{
+			uint32_t triangle = triangles[t];
+			if(emitted[triangle])
+				continue;
+			for(int j = 0; j < 3; j++)
+			{
+				uint32_t v = indices[triangle * 3 + j];
+				output.push_back(v);
+				dead_ends.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if(time - cache_time[v] > vertex_cache_size)
+				{
+					cache_time[v] = time++;
+				}
+			}
+			emitted[triangle] = true;
+		}
+
+		// Prefer the candidate that stays in the cache the longest, if all
+		// its remaining triangles would still fit
+		int next = -1;
+		int best_priority = -1;
+		for(uint32_t v : candidates)
+		{
+			if(live[v] == 0)
+				continue;
+			int priority = 0;
+			if(time - cache_time[v] + 2 * live[v] <= vertex_cache_size)
+			{
+				priority = int(time - cache_time[v]);
+			}
+			if(priority > best_priority)
+			{
+				best_priority = priority;
+				next = int(v);
+			}
+		}
+		if(next == -1)
+		{
+			// Dead end, go back to a recently used vertex or else scan
+			while(!dead_ends.empty() && next == -1)
+			{
+				uint32_t v = dead_ends.back();
+				dead_ends.pop_back();
+				if(live[v] > 0)
+					next = int(v);
+			}
+			for(; scan < num_vertices && next == -1; scan++)
+			{
+				if(live[scan] > 0)
+					next = int(scan);
+			}
+			if(next != -1 && time - cache_time[next] > vertex_cache_size)
+			{
+				cluster_starts.push_back(uint32_t(output.size() / 3));
+			}
+		}
+		fanning = next;
+	}
+	indices.swap(output);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Orders clusters of triangles so that those facing away from the
+// center of the mesh are drawn first, as they are the most likely to
+// occlude the others (ibid.)
+///////////////////////////////////////////////////////////////////////
+static void sortClustersForOverdraw(std::vector<uint32_t>& indices, const std::vector<uint32_t>& cluster_starts,
+                                    const std::vector<glm::vec3>& positions)
+{
+	const uint32_t num_clusters = uint32_t(cluster_starts.size());
+	const uint32_t num_triangles = uint32_t(indices.size() / 3);
+	if(num_clusters < 2)
+	{
+		return;
+	}
+	glm::vec3 mesh_center(0.0f);
+	for(uint32_t index : indices)
+	{
+		mesh_center += positions[index];
+	}
+	mesh_center /= float(indices.size());
+	std::vector<float> outwardness(num_clusters);
+	for(uint32_t c = 0; c < num_clusters; c++)
+	{
+		uint32_t end = c + 1 < num_clusters ? cluster_starts[c + 1] : num_triangles;
+		glm::vec3 center(0.0f), normal(0.0f);
+		for(uint32_t t = cluster_starts[c]; t < end; t++)
+		{
+			glm::vec3 p0 = positions[indices[t * 3 + 0]];
+			glm::vec3 p1 = positions[indices[t * 3 + 1]];
+			glm::vec3 p2 = positions[indices[t * 3 + 2]];
+			center += p0 + p1 + p2;
+			normal += glm::cross(p1 - p0, p2 - p0); // Area weighted
+		}
+		center /= float(3 * (end - cluster_starts[c]));
+		outwardness[c] = glm::dot(center - mesh_center, normal);
+	}
+	std::vector<uint32_t> order(num_clusters);
+	for(uint32_t c = 0; c < num_clusters; c++)
+	{
+		order[c] = c;
+	}
+	std::stable_sort(order.begin(), order.end(),
+	                 [&outwardness](uint32_t a, uint32_t b) { return outwardness[a] > outwardness[b]; });
+	std::vector<uint32_t> sorted;
+	sorted.reserve(indices.size());
+	for(uint32_t c : order)
+	{
+		uint32_t end = c + 1 < num_clusters ? cluster_starts[c + 1] : num_triangles;
+		sorted.insert(sorted.end(), indices.begin() + cluster_starts[c] * 3, indices.begin() + end * 3);
+	}
+	indices.swap(sorted);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Reorders the triangles of each mesh for the vertex cache (and
+// optionally overdraw), then renumbers the vertices in the order they
+// are first used so that vertex fetches are close to sequential. Works
+// on the CPU side of a model that has not been uploaded yet.
+///////////////////////////////////////////////////////////////////////
+static void optimizeVertexOrder(Model* model, bool sort_for_overdraw)
+{
+	const uint32_t num_vertices = uint32_t(model->m_positions.size());
+	std::vector<uint32_t> stamps(num_vertices);
+	float acmr_before = averageCacheMissRatio(model->m_indices.data(), model->m_indices.size(), stamps);
+
+	// Each mesh is reordered on its own, with its vertices numbered locally
+	std::vector<uint32_t> local_index(num_vertices, ~0u);
+	std::vector<uint32_t> global_index;
+	std::vector<uint32_t> mesh_indices;
+	std::vector<uint32_t> cluster_starts;
+	std::vector<glm::vec3> local_positions;
+	for(const auto& mesh : model->m_meshes)
+	{
+		uint32_t* indices = &model->m_indices[mesh.m_start_index];
+		global_index.clear();
+		mesh_indices.resize(mesh.m_number_of_indices);
+		for(uint32_t i = 0; i < mesh.m_number_of_indices; i++)
+		{
+			if(local_index[indices[i]] == ~0u)
+			{
+				local_index[indices[i]] = uint32_t(global_index.size());
+				global_index.push_back(indices[i]);
+			}
+			mesh_indices[i] = local_index[indices[i]];
+		}
+		tipsify(mesh_indices, uint32_t(global_index.size()), cluster_starts);
+		if(sort_for_overdraw)
+		{
+			local_positions.resize(global_index.size());
+			for(size_t v = 0; v < global_index.size(); v++)
+			{
+				local_positions[v] = model->m_positions[global_index[v]];
+			}
+			sortClustersForOverdraw(mesh_indices, cluster_starts, local_positions);
+		}
+		for(uint32_t i = 0; i < mesh.m_number_of_indices; i++)
+		{
+			indices[i] = global_index[mesh_indices[i]];
+		}
+		for(uint32_t v : global_index)
+		{
+			local_index[v] = ~0u;
+		}
+	}
+
+	// Renumber the vertices by first use, unused ones go last
+	std::vector<uint32_t>& new_index = local_index;
+	uint32_t next_index = 0;
+	for(uint32_t& index : model->m_indices)
+	{
+		if(new_index[index] == ~0u)
+		{
+			new_index[index] = next_index++;
+		}
+		index = new_index[index];
+	}
+	for(uint32_t v = 0; v < num_vertices; v++)
+	{
+		if(new_index[v] == ~0u)
+		{
+			new_index[v] = next_index++;
+		}
+	}
+	std::vector<glm::vec3> positions(num_vertices), normals(num_vertices);
+	std::vector<glm::vec2> texture_coordinates(num_vertices);
+	for(uint32_t v = 0; v < num_vertices; v++)
+	{
+		positions[new_index[v]] = model->m_positions[v];
+		normals[new_index[v]] = model->m_normals[v];
+		texture_coordinates[new_index[v]] = model->m_texture_coordinates[v];
+	}
+	model->m_positions.swap(positions);
+	model->m_normals.swap(normals);
+	model->m_texture_coordinates.swap(texture_coordinates);
+
+	float acmr_after = averageCacheMissRatio(model->m_indices.data(), model->m_indices.size(), stamps);
+	perf::setStatistic(model->m_filename + " ACMR before", acmr_before);
+	perf::setStatistic(model->m_filename + " ACMR after", acmr_after);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Binary cache of a loaded model (.lhmesh), written next to the OBJ file.
+// It holds the final vertex streams, indices, meshes and materials, and
+// is only used while the OBJ file has the same size, modification time
+// and contents as when the cache was written. After the header follow
+// the positions, normals, texture coordinates, indices, meshes,
+// materials and finally the characters of all names.
+///////////////////////////////////////////////////////////////////////
+static const char mesh_cache_magic[8] = { 'L', 'H', 'M', 'E', 'S', 'H', 0, 0 };
+static const uint32_t mesh_cache_version = 2;
+// What was done to the model before it was cached
+enum MeshCacheFlags : uint32_t
+{
+	MESH_CACHE_VERTEX_CACHE_OPTIMIZED = 1,
+	MESH_CACHE_OVERDRAW_SORTED = 2,
+};
+
+struct MeshCacheSource
+{
+	uint64_t size;
+	int64_t mtime;
+	uint64_t hash;
+};
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	MeshCacheSource source;
+	uint32_t num_vertices;
+	uint32_t num_indices;
+	uint32_t num_meshes;
+	uint32_t num_materials;
+	uint32_t strings_size;
+	uint32_t padding;
+};
+
+struct MeshCacheString
+{
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct MeshCacheMesh
+{
+	MeshCacheString name;
+	uint32_t material_idx;
+	uint32_t start_index;
+	uint32_t number_of_indices;
+};
+
+struct MeshCacheMaterial
+{
+	MeshCacheString name;
+	float color[3];
+	float reflectivity;
+	float shininess;
+	float metalness;
+	float fresnel;
+	float emission;
+	float transparency;
+	MeshCacheString textures[6];
+};
+
+// The textures of a material, in the order they are stored in the cache
+static const struct
+{
+	Texture Material::*texture;
+	int components;
+} material_textures[6] = { { &Material::m_color_texture, 4 },    { &Material::m_reflectivity_texture, 1 },
+	                       { &Material::m_shininess_texture, 1 }, { &Material::m_metalness_texture, 1 },
+	                       { &Material::m_fresnel_texture, 1 },   { &Material::m_emission_texture, 4 } };
+
+// Only the size and modification time, which are enough to accept a cache
+static bool readMeshCacheSource(const std::string& path, MeshCacheSource& source)
+{
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0)
+	{
+		return false;
+	}
+	source.size = uint64_t(st.st_size);
+	source.mtime = int64_t(st.st_mtime);
+	source.hash = 0;
+	return true;
+}
+
+// The contents decide when the modification time differs, e.g. after a checkout
+static bool hashMeshCacheSource(const std::string& path, MeshCacheSource& source)
+{
+	MappedFile file;
+	if(!file.open(path))
+	{
+		return false;
+	}
+	source.hash = 14695981039346656037ull; // FNV-1a
+	for(size_t i = 0; i < file.size(); i++)
+	{
+		source.hash = (source.hash ^ uint8_t(file.data()[i])) * 1099511628211ull;
+	}
+	return true;
+}
+
+static void writeMeshCache(const Model* model, const std::string& cache_path, const MeshCacheSource& source,
+                           uint32_t flags)
+{
+	std::string strings;
+	auto addString = [&strings](const std::string& str) {
+		MeshCacheString result = { uint32_t(strings.size()), uint32_t(str.size()) };
+		strings += str;
+		return result;
+	};
+	std::vector<MeshCacheMesh> meshes;
+	for(const auto& mesh : model->m_meshes)
+	{
+		meshes.push_back({ addString(mesh.m_name), mesh.m_material_idx, mesh.m_start_index, mesh.m_number_of_indices });
+	}
+	std::vector<MeshCacheMaterial> materials;
+	for(const auto& material : model->m_materials)
+	{
+		MeshCacheMaterial m;
+		m.name = addString(material.m_name);
+		m.color[0] = material.m_color.x;
+		m.color[1] = material.m_color.y;
+		m.color[2] = material.m_color.z;
+		m.reflectivity = material.m_reflectivity;
+		m.shininess = material.m_shininess;
+		m.metalness = material.m_metalness;
+		m.fresnel = material.m_fresnel;
+		m.emission = material.m_emission;
+		m.transparency = material.m_transparency;
+		for(int i = 0; i < 6; i++)
+		{
+			const Texture& texture = material.*material_textures[i].texture;
+			m.textures[i] = addString(texture.valid ? texture.filename : "");
+		}
+		materials.push_back(m);
+	}
+
+	MeshCacheHeader header;
+	memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+	header.version = mesh_cache_version;
+	header.flags = flags;
+	header.padding = 0;
+	header.source = source;
+	header.num_vertices = uint32_t(model->m_positions.size());
+	header.num_indices = uint32_t(model->m_indices.size());
+	header.num_meshes = uint32_t(meshes.size());
+	header.num_materials = uint32_t(materials.size());
+	header.strings_size = uint32_t(strings.size());
+
+	std::ofstream file(cache_path, std::ios::binary);
+	auto write = [&file](const void* data, size_t size) { file.write(static_cast<const char*>(data), size); };
+	write(&header, sizeof(header));
+	write(model->m_positions.data(), model->m_positions.size() * sizeof(glm::vec3));
+	write(model->m_normals.data(), model->m_normals.size() * sizeof(glm::vec3));
+	write(model->m_texture_coordinates.data(), model->m_texture_coordinates.size() * sizeof(glm::vec2));
+	write(model->m_indices.data(), model->m_indices.size() * sizeof(uint32_t));
+	write(meshes.data(), meshes.size() * sizeof(MeshCacheMesh));
+	write(materials.data(), materials.size() * sizeof(MeshCacheMaterial));
+	write(strings.data(), strings.size());
+	if(!file)
+	{
+		// E.g. a read-only directory, the model will just be parsed again
+		std::cout << "(could not write " << cache_path << ") " << std::flush;
+	}
+}
+
+// Returns nullptr if there is no valid cache for the source file
+static Model* loadMeshCache(const std::string& cache_path, const std::string& source_path, MeshCacheSource& source,
+                            uint32_t flags, const std::string& directory, const ModelLoadOptions& options)
+{
+	MappedFile file;
+	MeshCacheHeader header;
+	if(!file.open(cache_path) || file.size() < sizeof(header))
+	{
+		return nullptr;
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	if(memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) != 0 || header.version != mesh_cache_version
+	   || header.flags != flags || header.source.size != source.size)
+	{
+		return nullptr;
+	}
+	if(header.source.mtime != source.mtime
+	   && (!hashMeshCacheSource(source_path, source) || header.source.hash != source.hash))
+	{
+		return nullptr;
+	}
+	size_t num_vertices = header.num_vertices;
+	size_t num_indices = header.num_indices;
+	size_t expected_size = sizeof(header) + num_vertices * (2 * sizeof(glm::vec3) + sizeof(glm::vec2))
+	                       + num_indices * sizeof(uint32_t) + header.num_meshes * sizeof(MeshCacheMesh)
+	                       + header.num_materials * sizeof(MeshCacheMaterial) + header.strings_size;
+	if(file.size() != expected_size)
+	{
+		return nullptr;
+	}
+	const char* data = file.data() + sizeof(header);
+	auto next = [&data](size_t size) {
+		const char* section = data;
+		data += size;
+		return section;
+	};
+	auto positions = reinterpret_cast<const glm::vec3*>(next(num_vertices * sizeof(glm::vec3)));
+	auto normals = reinterpret_cast<const glm::vec3*>(next(num_vertices * sizeof(glm::vec3)));
+	auto texture_coordinates = reinterpret_cast<const glm::vec2*>(next(num_vertices * sizeof(glm::vec2)));
+	auto indices = reinterpret_cast<const uint32_t*>(next(num_indices * sizeof(uint32_t)));
+	auto meshes = reinterpret_cast<const MeshCacheMesh*>(next(header.num_meshes * sizeof(MeshCacheMesh)));
+	auto materials = reinterpret_cast<const MeshCacheMaterial*>(next(header.num_materials * sizeof(MeshCacheMaterial)));
+	const char* strings = next(header.strings_size);
+
+	// Check all indices and names before anything is created. An index out
+	// of range would make the GPU read past the vertex buffers.
+	for(size_t i = 0; i < num_indices; i++)
+	{
+		if(indices[i] >= num_vertices)
+		{
+			return nullptr;
+		}
+	}
+	auto validString = [&header](const MeshCacheString& str) {
+		return uint64_t(str.offset) + str.length <= header.strings_size;
+	};
+	for(uint32_t i = 0; i < header.num_meshes; i++)
+	{
+		if(!validString(meshes[i].name) || meshes[i].material_idx >= header.num_materials
+		   || uint64_t(meshes[i].start_index) + meshes[i].number_of_indices > num_indices)
+		{
+			return nullptr;
+		}
+	}
+	for(uint32_t i = 0; i < header.num_materials; i++)
+	{
+		bool valid = validString(materials[i].name);
+		for(const auto& texture : materials[i].textures)
+		{
+			valid = valid && validString(texture);
+		}
+		if(!valid)
+		{
+			return nullptr;
+		}
+	}
+	auto getString = [strings](const MeshCacheString& str) { return std::string(strings + str.offset, str.length); };
+
+	Model* model = new Model;
+	for(uint32_t i = 0; i < header.num_materials; i++)
+	{
+		const MeshCacheMaterial& m = materials[i];
+		Material material;
+		material.m_name = getString(m.name);
+		material.m_color = glm::vec3(m.color[0], m.color[1], m.color[2]);
+		material.m_reflectivity = m.reflectivity;
+		material.m_shininess = m.shininess;
+		material.m_metalness = m.metalness;
+		material.m_fresnel = m.fresnel;
+		material.m_emission = m.emission;
+		material.m_transparency = m.transparency;
+		for(int t = 0; t < 6; t++)
+		{
+			if(m.textures[t].length > 0)
+			{
+				(material.*material_textures[t].texture)
+				    .load(directory, getString(m.textures[t]), material_textures[t].components);
+			}
+		}
+		model->m_materials.push_back(material);
+	}
+	for(uint32_t i = 0; i < header.num_meshes; i++)
+	{
+		Mesh mesh;
+		mesh.m_name = getString(meshes[i].name);
+		mesh.m_material_idx = meshes[i].material_idx;
+		mesh.m_start_index = meshes[i].start_index;
+		mesh.m_number_of_indices = meshes[i].number_of_indices;
+		model->m_meshes.push_back(mesh);
+	}
+	// The GPU buffers are filled straight from the mapping, and the CPU side
+	// copies only made if they are used
+	uploadModel(model, positions, normals, texture_coordinates, num_vertices, indices, num_indices, options);
+	if(options.keep_vertex_data || options.weld_positions || options.build_adjacency)
+	{
+		model->m_positions.assign(positions, positions + num_vertices);
+		model->m_indices.assign(indices, indices + num_indices);
+	}
+	if(options.keep_vertex_data)
+	{
+		model->m_normals.assign(normals, normals + num_vertices);
+		model->m_texture_coordinates.assign(texture_coordinates, texture_coordinates + num_vertices);
+	}
+	return model;
+}
+
+Model* loadModelFromOBJ(std::string path, const ModelLoadOptions& options)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Separate filename into directory, base filename and extension
+	// NOTE: This can be made a LOT simpler as soon as compilers properly
+	//		 support std::filesystem (C++17)
+	///////////////////////////////////////////////////////////////////////
+	size_t separator = path.find_last_of("\\/");
+	std::string filename, extension, directory;
+	if(separator != std::string::npos)
+	{
+		filename = path.substr(separator + 1, path.size() - separator - 1);
+		directory = path.substr(0, separator + 1);
+	}
+	else
+	{
+		filename = path;
+		directory = "./";
+	}
+	separator = filename.find_last_of(".");
+	if(separator == std::string::npos)
+	{
+		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
+		exit(1);
+	}
+	extension = filename.substr(separator, filename.size() - separator);
+	filename = filename.substr(0, separator);
+
+	std::cout << "Loading " << path << "..." << std::flush;
+	MeshCacheSource source;
+	std::string cache_path = directory + filename + ".lhmesh";
+	uint32_t cache_flags = 0;
+	if(options.optimize_vertex_cache)
+	{
+		cache_flags |= MESH_CACHE_VERTEX_CACHE_OPTIMIZED;
+		if(options.optimize_overdraw)
+		{
+			cache_flags |= MESH_CACHE_OVERDRAW_SORTED;
+		}
+	}
+	bool use_cache = options.use_mesh_cache && readMeshCacheSource(path, source);
+	Model* model = use_cache ? loadMeshCache(cache_path, path, source, cache_flags, directory, options) : nullptr;
+	if(model == nullptr)
+	{
+		model = buildModelFromOBJ(path, directory);
+		model->m_filename = path;
+		if(options.optimize_vertex_cache)
+		{
+			optimizeVertexOrder(model, options.optimize_overdraw);
+		}
+		if(use_cache && hashMeshCacheSource(path, source))
+		{
+			writeMeshCache(model, cache_path, source, cache_flags);
+		}
+		uploadModel(model, model->m_positions.data(), model->m_normals.data(), model->m_texture_coordinates.data(),
+		            model->m_positions.size(), model->m_indices.data(), model->m_indices.size(), options);
+	}
+	model->m_name = filename;
+	model->m_filename = path;
+
+	if(options.weld_positions)
+	{
+		buildPositionWelding(model);
+	}
+	if(options.build_adjacency)
+	{
+		buildAdjacency(model);
+	}
+	if(!options.keep_vertex_data)
+	{
+		std::vector<glm::vec3>().swap(model->m_positions);
+		std::vector<glm::vec3>().swap(model->m_normals);
+		std::vector<glm::vec2>().swap(model->m_texture_coordinates);
+		std::vector<uint32_t>().swap(model->m_indices);
+	}
+
+	std::cout << "done.\n";
+	return model;
+}
+
+void saveModelToOBJ(Model* model, std::string path)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Separate filename into directory, base filename and extension
+	// NOTE: This can be made a LOT simpler as soon as compilers properly
+	//		 support std::filesystem (C++17)
+	///////////////////////////////////////////////////////////////////////
+	size_t separator = path.find_last_of("\\/");
+	std::string filename, extension, directory;
+	if(separator != std::string::npos)
+	{
+		filename = path.substr(separator + 1, path.size() - separator - 1);
+		directory = path.substr(0, separator + 1);
+	}
+	else
+	{
+		filename = path;
+		directory = "./";
+	}
+	separator = filename.find_last_of(".");
+	if(separator == std::string::npos)
+	{
+		std::cout << "Fatal: loadModelFromOBJ(): Expecting filename ending in '.obj'\n";
+		exit(1);
+	}
+	extension = filename.substr(separator, filename.size() - separator);
+	filename = filename.substr(0, separator);
+
+	///////////////////////////////////////////////////////////////////////
+	// Save Materials
+	///////////////////////////////////////////////////////////////////////
+	std::ofstream mat_file(directory + filename + ".mtl");
+	if(!mat_file.is_open())
+	{
+		std::cout << "Could not open file " << filename << " for writing.\n";
+		return;
+	}
+	mat_file << "# Exported by Chalmers Graphics Group\n";
+	for(auto mat : model->m_materials)
+	{
+		mat_file << "newmtl " << mat.m_name << "\n";
+		mat_file << "Kd " << mat.m_color.x << " " << mat.m_color.y << " " << mat.m_color.z << "\n";
+		mat_file << "Ks " << mat.m_reflectivity << " " << mat.m_reflectivity << " " << mat.m_reflectivity
+		         << "\n";
+		mat_file << "Pm " << mat.m_metalness << "\n";
+		mat_file << "Ps " << mat.m_fresnel << "\n";
+		mat_file << "Pr " << mat.m_shininess << "\n";
+		mat_file << "Ke " << mat.m_emission << " " << mat.m_emission << " " << mat.m_emission << "\n";
+		mat_file << "Tf " << mat.m_transparency << " " << mat.m_transparency << " " << mat.m_transparency
+		         << "\n";
+		if(mat.m_color_texture.valid)
+			mat_file << "map_Kd " << mat.m_color_texture.filename << "\n";
+		if(mat.m_reflectivity_texture.valid)
+			mat_file << "map_Ks " << mat.m_reflectivity_texture.filename << "\n";
+		if(mat.m_metalness_texture.valid)
+			mat_file << "map_Pm " << mat.m_metalness_texture.filename << "\n";
+		if(mat.m_fresnel_texture.valid)
+			mat_file << "map_Ps " << mat.m_fresnel_texture.filename << "\n";
+		if(mat.m_shininess_texture.valid)
+			mat_file << "map_Pr " << mat.m_shininess_texture.filename << "\n";
+		if(mat.m_emission_texture.valid)
+			mat_file << "map_Ke " << mat.m_emission_texture.filename << "\n";
+	}
+	mat_file.close();
+
+	///////////////////////////////////////////////////////////////////////
+	// Save geometry
+	///////////////////////////////////////////////////////////////////////
+	std::ofstream obj_file(directory + filename + ".obj");
+	if(!obj_file.is_open())
+	{
+		std::cout << "Could not open file " << filename << " for writing.\n";
+		return;
+	}
+	obj_file << "# Exported by Chalmers Graphics Group\n";
+	obj_file << "mtllib " << filename << ".mtl\n";
+
+	// Output unique vertices first
+	for(const auto& pos : model->m_positions) {
+		obj_file << "v " << pos.x << " " << pos.y << " " << pos.z << "\n";
+	}
+	for(const auto& normal : model->m_normals) {
+		obj_file << "vn " << normal.x << " " << normal.y << " " << normal.z << "\n";
+	}
+	for(const auto& texcoord : model->m_texture_coordinates) {
+		obj_file << "vt " << texcoord.x << " " << texcoord.y << "\n";
+	}
+
+	for(auto mesh : model->m_meshes)
+	{
+		obj_file << "o " << mesh.m_name << "\n";
+		obj_file << "g " << mesh.m_name << "\n";
+		obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
+
+		// Output faces using indices
+		int number_of_faces = mesh.m_number_of_indices / 3;
+		for(int i = 0; i < number_of_faces; i++)
+		{
+			// OBJ indices are 1-based
+			uint32_t idx0 = model->m_indices[mesh.m_start_index + i * 3 + 0] + 1;
+			uint32_t idx1 = model->m_indices[mesh.m_start_index + i * 3 + 1] + 1;
+			uint32_t idx2 = model->m_indices[mesh.m_start_index + i * 3 + 2] + 1;
+			obj_file << "f " << idx0 << "/" << idx0 << "/" << idx0 << " " // pos/texcoord/normal
+			         << idx1 << "/" << idx1 << "/" << idx1 << " "
+			         << idx2 << "/" << idx2 << "/" << idx2 << "\n";
+		}
+	}
+	obj_file.close();
+}
+
+///////////////////////////////////////////////////////////////////////
+// Free model
+///////////////////////////////////////////////////////////////////////
+void freeModel(Model* model)
 {
 	if(model != nullptr)
 		delete model;
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Loop through all Meshes in the Model and render them
+// Create a model sharing all GPU data but the positions with another one
 ///////////////////////////////////////////////////////////////////////
-void render(const Model* model, const bool submitMaterials)
+Model* createModelInstance(const Model* model)
+{
+	const Model* source = model->m_instance_of != nullptr ? model->m_instance_of : model;
+
+	Model* instance = new Model;
+	instance->m_name = model->m_name;
+	instance->m_filename = model->m_filename;
+	instance->m_materials = model->m_materials;
+	instance->m_meshes = model->m_meshes;
+	instance->m_positions = model->m_positions;
+	instance->m_normals_bo = model->m_normals_bo;
+	instance->m_texture_coordinates_bo = model->m_texture_coordinates_bo;
+	instance->m_indices_bo = model->m_indices_bo;
+	instance->m_static_attributes_bo = model->m_static_attributes_bo;
+	instance->m_materials_bo = model->m_materials_bo;
+	instance->m_has_material_textures = model->m_has_material_textures;
+	instance->m_compact_vertices = model->m_compact_vertices;
+	instance->m_index_size = model->m_index_size;
+	instance->m_vertex_face_offsets_bo = model->m_vertex_face_offsets_bo;
+	instance->m_vertex_faces_bo = model->m_vertex_faces_bo;
+	instance->m_vertex_vertex_offsets_bo = model->m_vertex_vertex_offsets_bo;
+	instance->m_vertex_vertices_bo = model->m_vertex_vertices_bo;
+	instance->m_welded_position_indices_bo = model->m_welded_position_indices_bo;
+	instance->m_instance_of = source;
+
+	// Copy the positions on the GPU rather than uploading them again
+	GLsizeiptr positions_size = model->m_positions.size() * sizeof(glm::vec3);
+	glGenBuffers(1, &instance->m_positions_bo);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, instance->m_positions_bo);
+	instance->m_dynamic_positions = source->m_dynamic_positions;
+	glBufferData(GL_COPY_WRITE_BUFFER, positions_size, nullptr,
+	             instance->m_dynamic_positions ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_READ_BUFFER, model->m_positions_bo);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, positions_size);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	// Its own draw commands, since their instance counts may differ
+	prepareDrawCommands(instance, 1);
+
+	glGenVertexArrays(1, &instance->m_vaob);
+	glBindVertexArray(instance->m_vaob);
+	setVertexAttributes(instance);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	return instance;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Point the position attribute (location 0) at an external buffer
+///////////////////////////////////////////////////////////////////////
+void bindPositionBuffer(const Model* model, uint32_t buffer)
+{
+	glBindVertexArray(model->m_vaob);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Point the normal attribute (location 1) at an external buffer
+///////////////////////////////////////////////////////////////////////
+void bindNormalBuffer(Model* model, uint32_t buffer)
+{
+	model->m_external_normals = true;
+	glBindVertexArray(model->m_vaob);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Upload a vector to a (new) shader storage buffer
+///////////////////////////////////////////////////////////////////////
+static void uploadStorageBuffer(uint32_t& buffer, const std::vector<uint32_t>& data)
+{
+	if(buffer == 0)
+	{
+		glGenBuffers(1, &buffer);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, data.size() * sizeof(uint32_t), data.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Gather the faces and neighbours around each vertex: count them, turn
+// the counts into offsets with a prefix sum, and then fill them in
+///////////////////////////////////////////////////////////////////////
+void buildAdjacency(Model* model)
+{
+	// With welded positions the rows belong to the positions, so that all the
+	// copies of a vertex split on a seam see the same faces and neighbours
+	bool welded = model->m_welded_position_indices.size() == model->m_positions.size();
+	size_t number_of_vertices = welded ? model->m_welded_positions.size() : model->m_positions.size();
+	size_t number_of_faces = model->m_indices.size() / 3;
+	const std::vector<uint32_t>& indices = model->m_indices;
+	auto row = [&](uint32_t index) { return welded ? model->m_welded_position_indices[index] : index; };
+
+	// Every corner adds its face to its vertex, and the two other corners
+	// of the face as neighbours
+	std::vector<uint32_t>& face_offsets = model->m_vertex_face_offsets;
+	face_offsets.assign(number_of_vertices + 1, 0);
+	for(size_t i = 0; i < number_of_faces * 3; i++)
+	{
+		face_offsets[row(indices[i]) + 1]++;
+	}
+	for(size_t v = 0; v < number_of_vertices; v++)
+	{
+		face_offsets[v + 1] += face_offsets[v];
+	}
+
+	std::vector<uint32_t>& faces = model->m_vertex_faces;
+	std::vector<uint32_t> neighbours(2 * face_offsets[number_of_vertices]);
+	faces.resize(face_offsets[number_of_vertices]);
+	std::vector<uint32_t> fill(face_offsets.begin(), face_offsets.end() - 1);
+	for(uint32_t f = 0; f < number_of_faces; f++)
+	{
+		for(int corner = 0; corner < 3; corner++)
+		{
+			uint32_t v = row(indices[3 * f + corner]);
+			uint32_t slot = fill[v]++;
+			faces[slot] = f;
+			neighbours[2 * slot] = row(indices[3 * f + (corner + 1) % 3]);
+			neighbours[2 * slot + 1] = row(indices[3 * f + (corner + 2) % 3]);
+		}
+	}
+
+	// Interior edges are seen from both of their faces, so remove the
+	// duplicates. Rows are short, so sorting each of them stays linear.
+	std::vector<uint32_t>& vertex_offsets = model->m_vertex_vertex_offsets;
+	std::vector<uint32_t>& vertices = model->m_vertex_vertices;
+	vertex_offsets.resize(number_of_vertices + 1);
+	vertices.clear();
+	vertices.reserve(neighbours.size() / 2);
+	vertex_offsets[0] = 0;
+	for(size_t v = 0; v < number_of_vertices; v++)
+	{
+		auto row_begin = neighbours.begin() + 2 * face_offsets[v];
+		auto row_end = neighbours.begin() + 2 * face_offsets[v + 1];
+		std::sort(row_begin, row_end);
+		vertices.insert(vertices.end(), row_begin, std::unique(row_begin, row_end));
+		vertex_offsets[v + 1] = uint32_t(vertices.size());
+	}
+
+	uploadStorageBuffer(model->m_vertex_face_offsets_bo, face_offsets);
+	uploadStorageBuffer(model->m_vertex_faces_bo, faces);
+	uploadStorageBuffer(model->m_vertex_vertex_offsets_bo, vertex_offsets);
+	uploadStorageBuffer(model->m_vertex_vertices_bo, vertices);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Give all vertices with bit-exactly the same position the same index
+///////////////////////////////////////////////////////////////////////
+void buildPositionWelding(Model* model)
+{
+	struct PositionBits
+	{
+		uint32_t x, y, z;
+		bool operator==(const PositionBits& o) const { return x == o.x && y == o.y && z == o.z; }
+	};
+	struct PositionBitsHash
+	{
+		size_t operator()(const PositionBits& p) const
+		{
+			return (size_t(p.x) * 73856093u) ^ (size_t(p.y) * 19349663u) ^ (size_t(p.z) * 83492791u);
+		}
+	};
+
+	std::unordered_map<PositionBits, uint32_t, PositionBitsHash> welded;
+	welded.reserve(model->m_positions.size());
+	model->m_welded_positions.clear();
+	model->m_welded_position_indices.resize(model->m_positions.size());
+	for(size_t v = 0; v < model->m_positions.size(); v++)
+	{
+		const glm::vec3& position = model->m_positions[v];
+		PositionBits key;
+		memcpy(&key, &position, sizeof(key));
+		auto inserted = welded.emplace(key, uint32_t(model->m_welded_positions.size()));
+		if(inserted.second)
+		{
+			model->m_welded_positions.push_back(position);
+		}
+		model->m_welded_position_indices[v] = inserted.first->second;
+	}
+
+	uploadStorageBuffer(model->m_welded_position_indices_bo, model->m_welded_position_indices);
+}
+
+///////////////////////////////////////////////////////////////////////
+// The render mode last set, and if it has been set at all
+///////////////////////////////////////////////////////////////////////
+static RenderMode current_render_mode = RenderMode::Fill;
+static bool render_mode_set = false;
+
+void setRenderMode(RenderMode mode)
+{
+	bool wireframe = mode == RenderMode::Wireframe;
+	bool color_writes = mode != RenderMode::DepthOnly;
+	if(!render_mode_set || wireframe != (current_render_mode == RenderMode::Wireframe))
+	{
+		glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
+	}
+	if(!render_mode_set || color_writes != (current_render_mode != RenderMode::DepthOnly))
+	{
+		glColorMask(color_writes, color_writes, color_writes, color_writes);
+	}
+	current_render_mode = mode;
+	render_mode_set = true;
+}
+
+RenderMode getRenderMode()
+{
+	return current_render_mode;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Draws the meshes whose materials have the given features among the
+// feature_mask bits of their texture mask, all of them if the mask is 0
+///////////////////////////////////////////////////////////////////////
+static void renderMeshes(GLuint shaderProgram, const Model* model, bool submitMaterials, int numInstances,
+                         uint32_t feature_mask, uint32_t features)
 {
 	glBindVertexArray(model->m_vaob);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+	glUniform1i(getUniformLocation(shaderProgram, "octahedral_normals"),
+	            model->m_compact_vertices && !model->m_external_normals);
+	GLint material_index_location = getUniformLocation(shaderProgram, "material_index");
+	if(submitMaterials)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, material_buffer_binding, model->m_materials_bo);
+	}
+	GLenum index_type = model->m_index_size == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+	// All meshes in one call, if the shaders can get the material index from
+	// the base instance and no textures have to be bound between the meshes.
+	// Without textures, all materials need the same variant. The commands
+	// for the instance count must have been prepared.
+	auto draw_commands = model->m_draw_commands_bos.find(numInstances);
+	if(GLEW_ARB_shader_draw_parameters && (!submitMaterials || !model->m_has_material_textures)
+	   && draw_commands != model->m_draw_commands_bos.end())
+	{
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_commands->second);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, index_type, nullptr, GLsizei(model->m_meshes.size()), 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		return;
+	}
 
+	// Otherwise one draw per mesh
 	for(auto& mesh : model->m_meshes)
 	{
+		const Material& material = model->m_materials[mesh.m_material_idx];
+		if((material.textureMask() & feature_mask) != features)
+		{
+			continue;
+		}
 		if(submitMaterials)
 		{
-			const Material& material = model->m_materials[mesh.m_material_idx];
 
-			bool has_color_texture = material.m_color_texture.valid;
-			bool has_reflectivity_texture = material.m_reflectivity_texture.valid;
-			bool has_metalness_texture = material.m_metalness_texture.valid;
-			bool has_fresnel_texture = material.m_fresnel_texture.valid;
-			bool has_shininess_texture = material.m_shininess_texture.valid;
-			bool has_emission_texture = material.m_emission_texture.valid;
-			if ( has_color_texture )
+			if ( material.m_color_texture.valid )
 			{
 				glActiveTexture( GL_TEXTURE0 );
 				glBindTexture( GL_TEXTURE_2D, material.m_color_texture.gl_id );
 			}
-			if(has_reflectivity_texture)
+			if ( material.m_reflectivity_texture.valid )
 			{
 				glActiveTexture( GL_TEXTURE1 );
 				glBindTexture( GL_TEXTURE_2D, material.m_reflectivity_texture.gl_id );
 			}
-			if ( has_metalness_texture )
+			if ( material.m_metalness_texture.valid )
 			{
 				glActiveTexture( GL_TEXTURE2 );
 				glBindTexture( GL_TEXTURE_2D, material.m_metalness_texture.gl_id );
 			}
-			if ( has_fresnel_texture )
+			if ( material.m_fresnel_texture.valid )
 			{
 				glActiveTexture( GL_TEXTURE3 );
 				glBindTexture( GL_TEXTURE_2D, material.m_fresnel_texture.gl_id );
 			}
-			if ( has_shininess_texture )
+			if ( material.m_shininess_texture.valid )
 			{
 				glActiveTexture( GL_TEXTURE4 );
 				glBindTexture( GL_TEXTURE_2D, material.m_shininess_texture.gl_id );
 			}
-			if ( has_emission_texture )
+			if ( material.m_emission_texture.valid )
 			{
 				glActiveTexture( GL_TEXTURE5 );
 				glBindTexture( GL_TEXTURE_2D, material.m_emission_texture.gl_id );
 			}
 			glActiveTexture( GL_TEXTURE0 );
-			GLint current_program = 0;
-			glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
-
-			setUniformSlow( current_program, "has_color_texture", has_color_texture );
-			setUniformSlow( current_program, "has_emission_texture", has_emission_texture );
-
-			setUniformSlow( current_program, "material_color", material.m_color );
-			setUniformSlow( current_program, "material_reflectivity", material.m_reflectivity );
-			setUniformSlow( current_program, "material_metalness", material.m_metalness );
-			setUniformSlow( current_program, "material_fresnel", material.m_fresnel );
-			setUniformSlow( current_program, "material_shininess", material.m_shininess );
-			setUniformSlow( current_program, "material_emission", material.m_emission );
-
-			// Actually unused in the labs
-			setUniformSlow( current_program, "has_reflectivity_texture", has_reflectivity_texture );
-			setUniformSlow( current_program, "has_metalness_texture", has_metalness_texture );
-			setUniformSlow( current_program, "has_fresnel_texture", has_fresnel_texture );
-			setUniformSlow( current_program, "has_shininess_texture", has_shininess_texture );
 
+			// Everything else about the material is in m_materials_bo. The
+			// index is also the base instance below, for shaders that use that.
+			glUniform1ui( material_index_location, mesh.m_material_idx );
 		}
-		
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		glDrawElements(GL_TRIANGLES, (GLsizei)mesh.m_number_of_indices, GL_UNSIGNED_INT, (const void*)(mesh.m_start_index * sizeof(uint32_t)));
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+		glDrawElementsInstancedBaseInstance(GL_TRIANGLES, (GLsizei)mesh.m_number_of_indices, index_type,
+		                                    (const void*)(size_t(mesh.m_start_index) * model->m_index_size),
+		                                    numInstances, mesh.m_material_idx);
 	}
 	glBindVertexArray(0);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
+
+///////////////////////////////////////////////////////////////////////
+// Loop through all Meshes in the Model and render them, in the current
+// render mode
+///////////////////////////////////////////////////////////////////////
+void render(const Model* model, const bool submitMaterials, const int numInstances)
+{
+	GLint current_program = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+	render(GLuint(current_program), model, submitMaterials, numInstances);
+}
+
+void render(uint32_t shaderProgram, const Model* model, const bool submitMaterials, const int numInstances)
+{
+	renderMeshes(shaderProgram, model, submitMaterials, numInstances, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// The feature combinations of a shader that the materials of a model's
+// meshes need
+///////////////////////////////////////////////////////////////////////
+static std::vector<uint32_t> getVariantFeatures(const ShaderPermutations& permutations, const Model* model)
+{
+	std::vector<uint32_t> features;
+	for(const Mesh& mesh : model->m_meshes)
+	{
+		uint32_t mesh_features = model->m_materials[mesh.m_material_idx].textureMask() & permutations.featureMask();
+		if(std::find(features.begin(), features.end(), mesh_features) == features.end())
+			features.push_back(mesh_features);
+	}
+	return features;
+}
+
+std::vector<uint32_t> getShaderVariants(ShaderPermutations& permutations, const Model* model)
+{
+	std::vector<uint32_t> programs;
+	for(uint32_t features : getVariantFeatures(permutations, model))
+	{
+		programs.push_back(permutations.getVariant(features));
+	}
+	return programs;
+}
+
+void render(ShaderPermutations& permutations, const Model* model, const bool submitMaterials, const int numInstances)
+{
+	if(!submitMaterials)
+	{
+		GLuint program = permutations.getVariant(0);
+		glUseProgram(program);
+		renderMeshes(program, model, false, numInstances, 0, 0);
+		return;
+	}
+	// The meshes drawn with each variant in turn
+	for(uint32_t features : getVariantFeatures(permutations, model))
+	{
+		GLuint program = permutations.getVariant(features);
+		glUseProgram(program);
+		renderMeshes(program, model, true, numInstances, permutations.featureMask(), features);
+	}
+}
 } // namespace labhelper
\ No newline at end of file
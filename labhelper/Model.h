@@ -1,10 +1,13 @@
 #pragma once
+#include <map>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
 
 namespace labhelper
 {
+class ShaderPermutations;
+
 struct Texture
 {
 	bool valid = false;
@@ -39,8 +42,25 @@ struct Material
 	Texture m_metalness_texture;
 	Texture m_fresnel_texture;
 	Texture m_emission_texture;
+	// Which of the textures are valid, see MaterialTextureBits
+	uint32_t textureMask() const;
 };
 
+// The bits of Material::textureMask(), also known by project/material.glsl
+enum MaterialTextureBits : uint32_t
+{
+	COLOR_TEXTURE_BIT = 1 << 0,
+	REFLECTIVITY_TEXTURE_BIT = 1 << 1,
+	SHININESS_TEXTURE_BIT = 1 << 2,
+	METALNESS_TEXTURE_BIT = 1 << 3,
+	FRESNEL_TEXTURE_BIT = 1 << 4,
+	EMISSION_TEXTURE_BIT = 1 << 5,
+};
+
+// The shader storage buffer binding render() binds the materials of a model to.
+// GL 4.3 only guarantees 8 bindings, and 0 - 3 hold the perturbed vertices.
+const uint32_t material_buffer_binding = 7;
+
 struct Mesh
 {
 	std::string m_name;
@@ -68,16 +88,147 @@ public:
 	std::vector<glm::vec2> m_texture_coordinates;
 	std::vector<uint32_t> m_indices;
 	// Buffers on GPU
-	uint32_t m_positions_bo;
-	uint32_t m_normals_bo;
-	uint32_t m_texture_coordinates_bo;
-	uint32_t m_indices_bo;
+	uint32_t m_positions_bo = 0;
+	uint32_t m_normals_bo = 0;
+	uint32_t m_texture_coordinates_bo = 0;
+	uint32_t m_indices_bo = 0;
+	// With ModelLoadOptions::interleave_static_attributes, the normal and
+	// texture coordinate of each vertex after each other in one immutable
+	// buffer, instead of m_normals_bo and m_texture_coordinates_bo
+	uint32_t m_static_attributes_bo = 0;
+	// The formats of the buffers on the GPU, see
+	// ModelLoadOptions::compact_vertices. If compact, m_normals_bo holds
+	// octahedral encoded normals as two snorm16 and m_texture_coordinates_bo
+	// two half floats per vertex.
+	bool m_compact_vertices = false;
+	// See ModelLoadOptions::dynamic_positions
+	bool m_dynamic_positions = false;
+	// Bytes per index in m_indices_bo, 2 or 4. An odd number of 16 bit
+	// indices is padded to a whole number of 32 bit words.
+	uint32_t m_index_size = 4;
+	// Set by bindNormalBuffer(), the normal attribute is then three floats
+	bool m_external_normals = false;
+	// Bytes per vertex of the normal and texture coordinate buffers
+	size_t normalSize() const { return m_compact_vertices ? 2 * sizeof(int16_t) : 3 * sizeof(float); }
+	size_t textureCoordinateSize() const { return m_compact_vertices ? 2 * sizeof(uint16_t) : 2 * sizeof(float); }
+	// Vertex adjacency in compressed sparse row form, built on request by
+	// buildAdjacency() and then also kept in shader storage buffers. The faces
+	// (triangles, i.e. index / 3) around vertex v are m_vertex_faces[i] for
+	// m_vertex_face_offsets[v] <= i < m_vertex_face_offsets[v + 1], and the
+	// neighbouring vertices likewise in m_vertex_vertices. If the positions
+	// are welded, v and the neighbours are welded position indices instead.
+	std::vector<uint32_t> m_vertex_face_offsets;
+	std::vector<uint32_t> m_vertex_faces;
+	std::vector<uint32_t> m_vertex_vertex_offsets;
+	std::vector<uint32_t> m_vertex_vertices;
+	uint32_t m_vertex_face_offsets_bo = 0;
+	uint32_t m_vertex_faces_bo = 0;
+	uint32_t m_vertex_vertex_offsets_bo = 0;
+	uint32_t m_vertex_vertices_bo = 0;
+	// Vertices split on UV or normal seams have the same position. Built on
+	// request by buildPositionWelding(), the unique positions and the index of
+	// each vertex' position among them, also kept in a shader storage buffer.
+	std::vector<glm::vec3> m_welded_positions;
+	std::vector<uint32_t> m_welded_position_indices;
+	uint32_t m_welded_position_indices_bo = 0;
+	// The materials in a shader storage buffer, indexed by material_index
+	// (see project/material.glsl)
+	uint32_t m_materials_bo = 0;
+	// One DrawElementsIndirectCommand per mesh, with the material index as
+	// the base instance, for drawing the whole model with one call. One
+	// immutable buffer per instance count, made by prepareDrawCommands().
+	std::map<int, uint32_t> m_draw_commands_bos;
+	// If any material has a texture, which render() has to bind per mesh
+	bool m_has_material_textures = false;
 	// Vertex Array Object
 	uint32_t m_vaob;
+	// Set for models made by createModelInstance(). They share everything but
+	// the positions with this model, which must outlive them.
+	const Model* m_instance_of = nullptr;
 };
 
-Model* loadModelFromOBJ(std::string filename);
+// Optional work done by loadModelFromOBJ()
+struct ModelLoadOptions
+{
+	// Build the vertex adjacency, see buildAdjacency()
+	bool build_adjacency = false;
+	// Find the vertices sharing positions, see buildPositionWelding()
+	bool weld_positions = false;
+	// Reorder the triangles of each mesh for the post-transform vertex cache,
+	// and the vertices in the order they are used. The average cache miss
+	// ratio before and after is reported as a perf statistic.
+	bool optimize_vertex_cache = false;
+	// Also order clusters of triangles to reduce overdraw, which costs some
+	// cache efficiency
+	bool optimize_overdraw = false;
+	// Upload the normals octahedral encoded in two snorm16, the texture
+	// coordinates as half floats, and the indices in 16 bits if there are
+	// fewer than 65535 vertices. The CPU side copies stay in full precision.
+	bool compact_vertices = false;
+	// Interleave the normals and texture coordinates, which never change, in
+	// one immutable buffer. The positions stay in a separate buffer.
+	bool interleave_static_attributes = false;
+	// The positions are rewritten after loading, e.g. by an optimizer, which
+	// makes m_positions_bo a dynamic buffer
+	bool dynamic_positions = false;
+	// Load from, or else write, a binary cache next to the OBJ file
+	// (<name>.lhmesh). It is used while the OBJ file has the same size and
+	// modification time, or else the same contents.
+	bool use_mesh_cache = false;
+	// Keep m_positions, m_normals, m_texture_coordinates and m_indices after
+	// the upload. Instances and saveModelToOBJ() need them. Without, a cached
+	// model goes straight from the mapped cache file to the GPU.
+	bool keep_vertex_data = true;
+};
+
+Model* loadModelFromOBJ(std::string filename, const ModelLoadOptions& options = ModelLoadOptions());
 void saveModelToOBJ(Model* model, std::string filename);
 void freeModel(Model* model);
-void render(const Model* model, const bool submitMaterials = true);
+// Creates another instance of a loaded model, with its own VAO and copy of the
+// positions but sharing the normal, texture coordinate and index buffers and
+// the materials. Only m_positions is kept on the CPU side of the instance.
+Model* createModelInstance(const Model* model);
+// How render() draws, see setRenderMode()
+enum class RenderMode
+{
+	Fill,
+	Wireframe,
+	// Only depth is written, e.g. for a depth pre-pass
+	DepthOnly,
+	// Filled, for a program writing ids to an integer target (which is never
+	// blended, so only the program differs from Fill)
+	ID,
+};
+// Sets the polygon mode and color writes for a render mode. Only what differs
+// from the last mode set is changed, so set it once at the start of each pass
+// rather than around individual draws.
+void setRenderMode(RenderMode mode);
+RenderMode getRenderMode();
+void render(const Model* model, const bool submitMaterials = true, const int numInstances = 1);
+// As above, for when the program in use is known, which saves asking GL for it
+void render(uint32_t shaderProgram, const Model* model, const bool submitMaterials = true,
+            const int numInstances = 1);
+// Draws each mesh with the variant of the shaders for the textures of its
+// material (Material::textureMask()), switching programs as needed. Uniforms
+// that render() doesn't set have to be in uniform blocks, or be set on all
+// the variants, which getShaderVariants() returns for a model.
+void render(ShaderPermutations& permutations, const Model* model, const bool submitMaterials = true,
+            const int numInstances = 1);
+std::vector<uint32_t> getShaderVariants(ShaderPermutations& permutations, const Model* model);
+// Make the commands for drawing numInstances instances of all meshes of the
+// model with one call, if not made already. render() draws the meshes one by
+// one for instance counts that have not been prepared.
+void prepareDrawCommands(Model* model, int numInstances);
+// Source the position attribute of the model's VAO from another buffer, e.g.
+// the output of a compute shader. The model still owns m_positions_bo.
+void bindPositionBuffer(const Model* model, uint32_t buffer);
+// The same for the normal attribute, which is then read as three floats even
+// for compact models. The model still owns m_normals_bo.
+void bindNormalBuffer(Model* model, uint32_t buffer);
+// Build and upload the vertex to face and vertex to vertex adjacency of the
+// model, in O(V + F). Call buildPositionWelding() first to get it per position.
+void buildAdjacency(Model* model);
+// Find the unique (bit-exact) positions of the model and which one each vertex
+// uses, and upload the latter
+void buildPositionWelding(Model* model);
 } // namespace labhelper
\ No newline at end of file
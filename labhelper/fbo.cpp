@@ -2,8 +2,9 @@
 #include <cstdint>
 #include <labhelper.h>
 
-FboInfo::FboInfo(int numberOfColorBuffers)
+FboInfo::FboInfo(int numberOfColorBuffers, int numberOfLayers)
     : isComplete(false), framebufferId(UINT32_MAX), depthBuffer(UINT32_MAX), width(0), height(0)
+    , numLayers(numberOfLayers)
 {
 	colorTextureTargets.resize(numberOfColorBuffers, UINT32_MAX);
 };
@@ -12,6 +13,7 @@ void FboInfo::resize(int w, int h)
 {
 	width = w;
 	height = h;
+	GLenum target = numLayers > 0 ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
 
 	///////////////////////////////////////////////////////////////////////
 	// if no texture indices yet, allocate
@@ -21,20 +23,20 @@ void FboInfo::resize(int w, int h)
 		if(colorTextureTarget == UINT32_MAX)
 		{
 			glGenTextures(1, &colorTextureTarget);
-			glBindTexture(GL_TEXTURE_2D, colorTextureTarget);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glBindTexture(target, colorTextureTarget);
+			glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		}
 	}
 
 	if(depthBuffer == UINT32_MAX)
 	{
 		glGenTextures(1, &depthBuffer);
-		glBindTexture(GL_TEXTURE_2D, depthBuffer);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(target, depthBuffer);
+		glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	}
 
 	///////////////////////////////////////////////////////////////////////
@@ -42,13 +44,28 @@ void FboInfo::resize(int w, int h)
 	///////////////////////////////////////////////////////////////////////
 	for(auto& colorTextureTarget : colorTextureTargets)
 	{
-		glBindTexture(GL_TEXTURE_2D, colorTextureTarget);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(target, colorTextureTarget);
+		if(numLayers > 0)
+		{
+			glTexImage3D(target, 0, GL_RGBA16F, width, height, numLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+		else
+		{
+			glTexImage2D(target, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
 	}
 
-	glBindTexture(GL_TEXTURE_2D, depthBuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT,
-	             nullptr);
+	glBindTexture(target, depthBuffer);
+	if(numLayers > 0)
+	{
+		glTexImage3D(target, 0, GL_DEPTH_COMPONENT32, width, height, numLayers, 0, GL_DEPTH_COMPONENT,
+		             GL_FLOAT, nullptr);
+	}
+	else
+	{
+		glTexImage2D(target, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT,
+		             nullptr);
+	}
 
 	///////////////////////////////////////////////////////////////////////
 	// Bind textures to framebuffer (if not already done)
@@ -61,11 +78,19 @@ void FboInfo::resize(int w, int h)
 		glGenFramebuffers(1, &framebufferId);
 		glBindFramebuffer(GL_FRAMEBUFFER, framebufferId);
 
-		// Bind the color textures as color attachments
+		// Bind the color textures as color attachments. Array textures are
+		// attached as layered, so the layer can be picked with gl_Layer.
 		for(int i = 0; i < int(colorTextureTargets.size()); i++)
 		{
-			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D,
-			                       colorTextureTargets[i], 0);
+			if(numLayers > 0)
+			{
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, colorTextureTargets[i], 0);
+			}
+			else
+			{
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D,
+				                       colorTextureTargets[i], 0);
+			}
 		}
 		GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2,
 			                     GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5,
@@ -73,7 +98,14 @@ void FboInfo::resize(int w, int h)
 		glDrawBuffers(int(colorTextureTargets.size()), attachments);
 
 		// bind the texture as depth attachment (to the currently bound framebuffer)
-		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthBuffer, 0);
+		if(numLayers > 0)
+		{
+			glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthBuffer, 0);
+		}
+		else
+		{
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthBuffer, 0);
+		}
 
 		// check if framebuffer is complete
 		isComplete = checkFramebufferComplete();
@@ -8,9 +8,10 @@ public:
 	GLuint depthBuffer;
 	int width;
 	int height;
+	int numLayers; // 0 for 2D textures, otherwise the layer count of layered 2D array textures
 	bool isComplete;
 
-	FboInfo(int numberOfColorBuffers = 1);
+	FboInfo(int numberOfColorBuffers = 1, int numberOfLayers = 0);
 		
 	void resize(int w, int h);
 	bool checkFramebufferComplete(void);
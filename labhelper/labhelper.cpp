@@ -11,6 +11,14 @@
 
 #include <GL/glew.h>
 
+#if defined(LABHELPER_HEADLESS_EGL)
+// We only use EGL without a window system, so keep X11 out of the way
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 // STB_IMAGE for loading images of many filetypes
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -24,6 +32,9 @@
 #include <cstdlib>
 
 #include <vector>
+#include <chrono>
+#include <filesystem>
+#include <unordered_map>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
@@ -122,6 +133,108 @@ SDL_Window* init_window_SDL(std::string caption, int width, int height)
 	return window;
 }
 
+#if defined(LABHELPER_HEADLESS_EGL)
+static EGLDisplay s_egl_display = EGL_NO_DISPLAY;
+static EGLContext s_egl_context = EGL_NO_CONTEXT;
+#endif
+
+bool init_headless_EGL(bool debugContext)
+{
+#if defined(LABHELPER_HEADLESS_EGL)
+	// Prefer a surfaceless display, which needs neither a window system nor a
+	// GPU (Mesa falls back to llvmpipe). Otherwise try the default display.
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+	    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if(getPlatformDisplay != nullptr)
+	{
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if(display == EGL_NO_DISPLAY)
+	{
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	EGLint major, minor;
+	if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		fprintf(stderr, "%s: 0x%x\n", "Couldn't initialize EGL", eglGetError());
+		return false;
+	}
+	if(!eglBindAPI(EGL_OPENGL_API))
+	{
+		fprintf(stderr, "%s: 0x%x\n", "EGL does not support OpenGL", eglGetError());
+		return false;
+	}
+
+	const EGLint config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config;
+	EGLint nof_configs = 0;
+	if(!eglChooseConfig(display, config_attributes, &config, 1, &nof_configs) || nof_configs == 0)
+	{
+		fprintf(stderr, "%s: 0x%x\n", "Couldn't find an EGL config", eglGetError());
+		return false;
+	}
+
+	// Request an OpenGL 4.3 core context, we need compute shaders
+	const EGLint context_attributes[] = { EGL_CONTEXT_MAJOR_VERSION_KHR,
+		                                  4,
+		                                  EGL_CONTEXT_MINOR_VERSION_KHR,
+		                                  3,
+		                                  EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR,
+		                                  EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+		                                  EGL_CONTEXT_FLAGS_KHR,
+		                                  debugContext ? EGL_CONTEXT_OPENGL_DEBUG_BIT_KHR : 0,
+		                                  EGL_NONE };
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
+	if(context == EGL_NO_CONTEXT)
+	{
+		fprintf(stderr, "%s: 0x%x\n", "Failed to create OpenGL context", eglGetError());
+		return false;
+	}
+
+	// No surface at all, we only ever render to framebuffer objects
+	if(!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		fprintf(stderr, "%s: 0x%x\n", "Failed to make OpenGL context current", eglGetError());
+		return false;
+	}
+	s_egl_display = display;
+	s_egl_context = context;
+
+	// Initialize GLEW. A GLEW built for GLX complains that there is no GLX
+	// display, but has loaded the core and extension functions by then.
+	glewExperimental = GL_TRUE;
+	GLenum glew_status = glewInit();
+#if defined(GLEW_ERROR_NO_GLX_DISPLAY)
+	if(glew_status == GLEW_ERROR_NO_GLX_DISPLAY)
+	{
+		glew_status = GLEW_OK;
+	}
+#endif
+	if(glew_status != GLEW_OK)
+	{
+		fprintf(stderr, "%s: %s\n", "Couldn't initialize GLEW", glewGetErrorString(glew_status));
+		return false;
+	}
+	// glewInit() may leave a GL error behind in a core context
+	glGetError();
+
+	// Check OpenGL properties
+	labhelper::startupGLDiagnostics();
+	if(debugContext)
+	{
+		labhelper::setupGLDebugMessages();
+	}
+
+	// Flip textures vertically so they don't end up upside-down.
+	stbi_set_flip_vertically_on_load(true);
+	return true;
+#else
+	fprintf(stderr, "%s\n", "labhelper was built without EGL, headless mode is not available");
+	return false;
+#endif
+}
+
 void newFrame( SDL_Window* window )
 {
 	ImGui_ImplOpenGL3_NewFrame();
@@ -183,6 +296,17 @@ void shutDown(SDL_Window* window)
 	SDL_Quit();
 }
 
+void shutDownHeadless()
+{
+#if defined(LABHELPER_HEADLESS_EGL)
+	eglMakeCurrent(s_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(s_egl_display, s_egl_context);
+	eglTerminate(s_egl_display);
+	s_egl_display = EGL_NO_DISPLAY;
+	s_egl_context = EGL_NO_CONTEXT;
+#endif
+}
+
 GLuint loadCubeMap(const char* facePosX,
                    const char* faceNegX,
                    const char* facePosY,
@@ -558,111 +682,338 @@ std::string GetShaderProgramInfoLog(GLuint obj)
 	return log;
 }
 
-GLuint loadShaderProgram(const std::string& vertexShader, const std::string& fragmentShader, bool allow_errors)
+///////////////////////////////////////////////////////////////////////////////
+// Reads a shader source file, replacing every line of the form
+//   #include "file"
+// with the contents of that file, relative to the including file. Lets shaders
+// share declarations, e.g. of buffer layouts, without copying them around.
+///////////////////////////////////////////////////////////////////////////////
+static bool readShaderSource(const std::string& filename, std::string& source, int depth = 0)
+{
+	std::ifstream file(filename);
+	if(!file || depth > 16)
+	{
+		source += "#error Failed to read \"" + filename + "\"\n";
+		return false;
+	}
+	std::string directory = filename.substr(0, filename.find_last_of("/\\") + 1);
+
+	bool ok = true;
+	std::string line;
+	while(std::getline(file, line))
+	{
+		size_t start = line.find_first_not_of(" \t");
+		if(start != std::string::npos && line.compare(start, 8, "#include") == 0)
+		{
+			size_t open = line.find('"', start);
+			size_t close = line.find('"', open + 1);
+			if(open != std::string::npos && close != std::string::npos)
+			{
+				ok &= readShaderSource(directory + line.substr(open + 1, close - open - 1), source, depth + 1);
+				continue;
+			}
+		}
+		source += line;
+		source += '\n';
+	}
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Inserts a #define for each of the defines right after the #version line,
+// which has to come first. "NAME" or "NAME VALUE" both work.
+///////////////////////////////////////////////////////////////////////////////
+static void insertDefines(std::string& source, const std::vector<std::string>& defines)
+{
+	if(defines.empty())
+		return;
+	size_t position = 0;
+	size_t start = source.find_first_not_of(" \t\r\n");
+	if(start != std::string::npos && source.compare(start, 8, "#version") == 0)
+	{
+		position = source.find('\n', start);
+		position = position == std::string::npos ? source.size() : position + 1;
+	}
+	std::string lines;
+	for(const std::string& define : defines)
+	{
+		lines += "#define " + define + "\n";
+	}
+	// Keep the line numbers in error messages right
+	lines += "#line " + std::to_string(std::count(source.begin(), source.begin() + position, '\n') + 1) + "\n";
+	source.insert(position, lines);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The complete source of a shader stage, as it is compiled
+///////////////////////////////////////////////////////////////////////////////
+static std::string loadShaderSource(const std::string& filename, const std::vector<std::string>& defines)
 {
-	GLuint vShader = glCreateShader(GL_VERTEX_SHADER);
-	GLuint fShader = glCreateShader(GL_FRAGMENT_SHADER);
+	std::string source;
+	readShaderSource(filename, source);
+	insertDefines(source, defines);
+	return source;
+}
 
-	std::ifstream vs_file(vertexShader);
-	std::string vs_src((std::istreambuf_iterator<char>(vs_file)), std::istreambuf_iterator<char>());
+///////////////////////////////////////////////////////////////////////////////
+// Program binary cache. Linked programs are stored in the cache directory,
+// named by a hash of the complete sources of their stages (so including the
+// defines and included files) and of the driver. A file is only ever used by
+// the exact same sources on the same driver, and the driver may still reject
+// it, e.g. after an update that didn't change the version string, in which
+// case the program is compiled again.
+///////////////////////////////////////////////////////////////////////////////
+static std::string programBinaryCacheDirectory;
+static const char program_binary_magic[4] = { 'L', 'H', 'P', 'B' };
+
+void setProgramBinaryCacheDirectory(const std::string& directory)
+{
+	programBinaryCacheDirectory = directory;
+}
 
-	std::ifstream fs_file(fragmentShader);
-	std::string fs_src((std::istreambuf_iterator<char>(fs_file)), std::istreambuf_iterator<char>());
+static uint64_t hashString(uint64_t hash, const std::string& string)
+{
+	// FNV-1a, including the terminating null so that concatenations differ
+	for(size_t i = 0; i <= string.size(); i++)
+	{
+		hash ^= uint8_t(string.c_str()[i]);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
 
-	const char* vs = vs_src.c_str();
-	const char* fs = fs_src.c_str();
+///////////////////////////////////////////////////////////////////////////////
+// The cache file for a program with the given stage sources, or an empty
+// string if programs aren't cached
+///////////////////////////////////////////////////////////////////////////////
+static std::string programBinaryCacheFile(const std::vector<std::string>& sources)
+{
+	if(programBinaryCacheDirectory.empty())
+		return std::string();
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	if(numFormats == 0)
+		return std::string();
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for(GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION })
+	{
+		const char* string = reinterpret_cast<const char*>(glGetString(name));
+		hash = hashString(hash, string != nullptr ? string : "");
+	}
+	for(const std::string& source : sources)
+	{
+		hash = hashString(hash, source);
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+	return programBinaryCacheDirectory + "/" + name;
+}
 
-	glShaderSource(vShader, 1, &vs, nullptr);
-	glShaderSource(fShader, 1, &fs, nullptr);
+///////////////////////////////////////////////////////////////////////////////
+// Returns the cached program, or 0 if there is none or the driver rejects it
+///////////////////////////////////////////////////////////////////////////////
+static GLuint loadProgramBinary(const std::string& cacheFile)
+{
+	if(cacheFile.empty())
+		return 0;
+	std::ifstream file(cacheFile, std::ios::binary);
+	if(!file)
+		return 0;
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	const size_t headerSize = sizeof(program_binary_magic) + sizeof(GLenum);
+	if(data.size() <= headerSize || memcmp(data.data(), program_binary_magic, sizeof(program_binary_magic)) != 0)
+		return 0;
+	GLenum format;
+	memcpy(&format, data.data() + sizeof(program_binary_magic), sizeof(GLenum));
+	// An unknown format would raise a GL error rather than just fail
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	std::vector<GLint> formats(numFormats);
+	glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+	if(std::find(formats.begin(), formats.end(), GLint(format)) == formats.end())
+		return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, format, data.data() + headerSize, GLsizei(data.size() - headerSize));
+	GLint linkOk = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+	if(!linkOk)
+	{
+		deleteShaderProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+static void saveProgramBinary(GLuint program, const std::string& cacheFile)
+{
+	if(cacheFile.empty())
+		return;
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+
+	std::error_code error;
+	std::filesystem::create_directories(programBinaryCacheDirectory, error);
+	// Written to a unique temporary file first, so that other processes never
+	// see a partially written cache file
+	std::string temporaryFile =
+	        cacheFile + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+	{
+		std::ofstream file(temporaryFile, std::ios::binary);
+		file.write(program_binary_magic, sizeof(program_binary_magic));
+		file.write(reinterpret_cast<const char*>(&format), sizeof(GLenum));
+		file.write(binary.data(), length);
+		if(!file)
+		{
+			file.close();
+			std::filesystem::remove(temporaryFile, error);
+			return;
+		}
+	}
+	std::filesystem::rename(temporaryFile, cacheFile, error);
+	if(error)
+		std::filesystem::remove(temporaryFile, error);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compiles one shader stage. Returns 0, after reporting the error, on failure.
+///////////////////////////////////////////////////////////////////////////////
+static GLuint compileShader(GLenum type, const std::string& src, const char* stageName, bool allow_errors)
+{
+	GLuint shader = glCreateShader(type);
+
+	const char* source = src.c_str();
+
+	glShaderSource(shader, 1, &source, nullptr);
 	// text data is not needed beyond this point
 
-	glCompileShader(vShader);
+	glCompileShader(shader);
 	int compileOk = 0;
-	glGetShaderiv(vShader, GL_COMPILE_STATUS, &compileOk);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compileOk);
 	if(!compileOk)
 	{
-		std::string err = GetShaderInfoLog(vShader);
+		std::string err = GetShaderInfoLog(shader);
+		glDeleteShader(shader);
 		if(allow_errors)
 		{
-			non_fatal_error(err, "Vertex Shader");
+			non_fatal_error(err, stageName);
 		}
 		else
 		{
-			fatal_error(err, "Vertex Shader");
+			fatal_error(err, stageName);
 		}
 		return 0;
 	}
+	return shader;
+}
 
-	glCompileShader(fShader);
-	glGetShaderiv(fShader, GL_COMPILE_STATUS, &compileOk);
-	if(!compileOk)
+GLuint loadShaderProgram(const std::string& vertexShader, const std::string& fragmentShader, bool allow_errors)
+{
+	return loadShaderProgram(vertexShader, std::string(), fragmentShader, allow_errors);
+}
+
+GLuint loadShaderProgram(const std::string& vertexShader,
+                         const std::string& geometryShader,
+                         const std::string& fragmentShader,
+                         bool allow_errors)
+{
+	return loadShaderProgram(vertexShader, geometryShader, fragmentShader, std::vector<std::string>(), allow_errors);
+}
+
+GLuint loadShaderProgram(const std::string& vertexShader,
+                         const std::string& geometryShader,
+                         const std::string& fragmentShader,
+                         const std::vector<std::string>& defines,
+                         bool allow_errors)
+{
+	std::string vSource = loadShaderSource(vertexShader, defines);
+	std::string gSource = geometryShader.empty() ? std::string() : loadShaderSource(geometryShader, defines);
+	std::string fSource = loadShaderSource(fragmentShader, defines);
+	std::string cacheFile = programBinaryCacheFile({ vSource, gSource, fSource });
+	GLuint cachedProgram = loadProgramBinary(cacheFile);
+	if(cachedProgram != 0)
+		return cachedProgram;
+
+	GLuint vShader = compileShader(GL_VERTEX_SHADER, vSource, "Vertex Shader", allow_errors);
+	if(vShader == 0)
+		return 0;
+
+	GLuint gShader = 0;
+	if(!geometryShader.empty())
 	{
-		std::string err = GetShaderInfoLog(fShader);
-		if(allow_errors)
-		{
-			non_fatal_error(err, "Fragment Shader");
-		}
-		else
+		gShader = compileShader(GL_GEOMETRY_SHADER, gSource, "Geometry Shader", allow_errors);
+		if(gShader == 0)
 		{
-			fatal_error(err, "Fragment Shader");
+			glDeleteShader(vShader);
+			return 0;
 		}
+	}
+
+	GLuint fShader = compileShader(GL_FRAGMENT_SHADER, fSource, "Fragment Shader", allow_errors);
+	if(fShader == 0)
+	{
+		glDeleteShader(vShader);
+		glDeleteShader(gShader);
 		return 0;
 	}
 
 	GLuint shaderProgram = glCreateProgram();
 	glAttachShader(shaderProgram, fShader);
 	glDeleteShader(fShader);
+	if(gShader != 0)
+	{
+		glAttachShader(shaderProgram, gShader);
+		glDeleteShader(gShader);
+	}
 	glAttachShader(shaderProgram, vShader);
 	glDeleteShader(vShader);
+	if(!cacheFile.empty())
+		glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	if(!allow_errors)
 		CHECK_GL_ERROR();
 
 	if(!linkShaderProgram(shaderProgram, allow_errors))
 		return 0;
 
+	saveProgramBinary(shaderProgram, cacheFile);
 	return shaderProgram;
 }
 
 GLuint loadComputeShaderProgram(const std::string& computeShader, bool allowErrors) {
-	GLuint cShader = glCreateShader(GL_COMPUTE_SHADER);
-
-	std::ifstream cs_file(computeShader);
-	std::string cs_src((std::istreambuf_iterator<char>(cs_file)), std::istreambuf_iterator<char>());
-
-	const char* cs = cs_src.c_str();
-
-	printf("IN HERE, %d", cs_src.length());
-	std::cout << *cs << "\n\00";
-
-	glShaderSource(cShader, 1, &cs, nullptr);
-	// text data is not needed beyond this point
+	return loadComputeShaderProgram(computeShader, std::vector<std::string>(), allowErrors);
+}
 
-	glCompileShader(cShader);
-	int compileOk = 0;
-	glGetShaderiv(cShader, GL_COMPILE_STATUS, &compileOk);
-	if(!compileOk)
-	{
-		std::string err = GetShaderInfoLog(cShader);
-		if(allowErrors)
-		{
-			non_fatal_error(err, "Compute Shader");
-		}
-		else
-		{
-			fatal_error(err, "Compute Shader");
-		}
+GLuint loadComputeShaderProgram(const std::string& computeShader, const std::vector<std::string>& defines,
+                                bool allowErrors)
+{
+	std::string cSource = loadShaderSource(computeShader, defines);
+	std::string cacheFile = programBinaryCacheFile({ cSource });
+	GLuint cachedProgram = loadProgramBinary(cacheFile);
+	if(cachedProgram != 0)
+		return cachedProgram;
+
+	GLuint cShader = compileShader(GL_COMPUTE_SHADER, cSource, "Compute Shader", allowErrors);
+	if(cShader == 0)
 		return 0;
-	}
 
 	GLuint computeShaderProgram = glCreateProgram();
 	glAttachShader(computeShaderProgram, cShader);
 	glDeleteShader(cShader);
+	if(!cacheFile.empty())
+		glProgramParameteri(computeShaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	if(!allowErrors)
 		CHECK_GL_ERROR();
 
 	if(!linkShaderProgram(computeShaderProgram, allowErrors))
 		return 0;
 
+	saveProgramBinary(computeShaderProgram, cacheFile);
 	return computeShaderProgram;
 }
 
@@ -687,6 +1038,88 @@ bool linkShaderProgram(GLuint shaderProgram, bool allow_errors)
 	return true;
 }
 
+GLuint ShaderPermutations::load(const std::string& vertexShader,
+                                const std::string& geometryShader,
+                                const std::string& fragmentShader,
+                                const std::vector<std::string>& featureDefines,
+                                bool allow_errors)
+{
+	GLuint program = loadShaderProgram(vertexShader, geometryShader, fragmentShader, std::vector<std::string>(),
+	                                   allow_errors);
+	if(program == 0)
+	{
+		return 0;
+	}
+	// The previous variants are not deleted, like other replaced programs,
+	// but kept to fall back on if the new shaders fail for some features
+	m_previous_variants.swap(m_variants);
+	m_variants.clear();
+	m_variants[0] = program;
+	m_allow_errors = allow_errors;
+	m_vertex_shader = vertexShader;
+	m_geometry_shader = geometryShader;
+	m_fragment_shader = fragmentShader;
+	m_feature_defines = featureDefines;
+	m_feature_mask = 0;
+	for(size_t i = 0; i < featureDefines.size() && i < 32; i++)
+	{
+		if(!featureDefines[i].empty())
+			m_feature_mask |= 1u << i;
+	}
+	return program;
+}
+
+GLuint ShaderPermutations::getVariant(uint32_t features)
+{
+	features &= m_feature_mask;
+	auto variant = m_variants.find(features);
+	if(variant != m_variants.end())
+	{
+		return variant->second;
+	}
+	std::vector<std::string> defines;
+	for(size_t i = 0; i < m_feature_defines.size(); i++)
+	{
+		if(features & (1u << i))
+			defines.push_back(m_feature_defines[i]);
+	}
+	GLuint program = loadShaderProgram(m_vertex_shader, m_geometry_shader, m_fragment_shader, defines,
+	                                   m_allow_errors);
+	if(program == 0)
+	{
+		// Keep drawing with the variant of the previous shaders, or the
+		// variant without features, rather than retrying every frame
+		auto previous = m_previous_variants.find(features);
+		program = previous != m_previous_variants.end() ? previous->second : m_variants[0];
+	}
+	m_variants[features] = program;
+	return program;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The work group size of every program seen by getComputeWorkGroupSize(), so
+// that dispatches don't query the program. Forgotten by deleteShaderProgram().
+///////////////////////////////////////////////////////////////////////////////
+static std::unordered_map<GLuint, glm::uvec3> workGroupSizes;
+
+glm::uvec3 getComputeWorkGroupSize(GLuint computeShaderProgram)
+{
+	auto program = workGroupSizes.find(computeShaderProgram);
+	if(program == workGroupSizes.end())
+	{
+		GLint size[3];
+		glGetProgramiv(computeShaderProgram, GL_COMPUTE_WORK_GROUP_SIZE, size);
+		program = workGroupSizes.emplace(computeShaderProgram, glm::uvec3(size[0], size[1], size[2])).first;
+	}
+	return program->second;
+}
+
+void dispatchCompute(GLuint computeShaderProgram, const glm::uvec3& numInvocations)
+{
+	glm::uvec3 groupSize = getComputeWorkGroupSize(computeShaderProgram);
+	glm::uvec3 numGroups = (numInvocations + groupSize - 1u) / groupSize;
+	glDispatchCompute(numGroups.x, numGroups.y, numGroups.z);
+}
 
 GLuint createAddAttribBuffer(GLuint vertexArrayObject,
                              const void* data,
@@ -712,6 +1145,51 @@ GLuint createAddAttribBuffer(GLuint vertexArrayObject,
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// The locations of the active uniforms of every program seen by
+// getUniformLocation(). GL reuses the names of deleted programs, so programs
+// have to be deleted with deleteShaderProgram(), which forgets them.
+///////////////////////////////////////////////////////////////////////////////
+static std::unordered_map<GLuint, std::unordered_map<std::string, GLint>> uniformLocations;
+
+void deleteShaderProgram(GLuint shaderProgram)
+{
+	uniformLocations.erase(shaderProgram);
+	workGroupSizes.erase(shaderProgram);
+	glDeleteProgram(shaderProgram);
+}
+
+GLint getUniformLocation(GLuint shaderProgram, const std::string& name)
+{
+	auto program = uniformLocations.find(shaderProgram);
+	if(program == uniformLocations.end())
+	{
+		program = uniformLocations.emplace(shaderProgram, std::unordered_map<std::string, GLint>()).first;
+		GLint numUniforms = 0, maxNameLength = 0;
+		glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORMS, &numUniforms);
+		glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+		std::vector<char> uniformName(std::max(maxNameLength, 1));
+		for(GLint i = 0; i < numUniforms; i++)
+		{
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(shaderProgram, GLuint(i), GLsizei(uniformName.size()), nullptr, &size, &type,
+			                   uniformName.data());
+			// Members of uniform blocks have no location
+			GLint location = glGetUniformLocation(shaderProgram, uniformName.data());
+			if(location < 0)
+				continue;
+			std::string key = uniformName.data();
+			program->second[key] = location;
+			// Arrays are reported as "name[0]", but are also set by plain name
+			if(key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+				program->second[key.substr(0, key.size() - 3)] = location;
+		}
+	}
+	auto location = program->second.find(name);
+	return location != program->second.end() ? location->second : -1;
+}
+
 void setUniformSlow(GLuint shaderProgram, const char* name, const glm::mat4& matrix)
 {
 	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, name), 1, false, &matrix[0].x);
@@ -8,6 +8,8 @@
 #include <glm/glm.hpp>
 
 #include <string>
+#include <vector>
+#include <unordered_map>
 #include <cassert>
 
 #include <SDL.h>
@@ -87,6 +89,16 @@ void non_fatal_error(std::string errorString, std::string title = std::string())
 	*/
 SDL_Window* init_window_SDL(std::string caption, int width = 1280, int height = 720);
 
+/**
+	* Initialize an OpenGL context without any window, for running on machines
+	* without a display. Uses EGL on a surfaceless display (as provided by e.g.
+	* Mesa llvmpipe), and only works when labhelper was built with EGL.
+	* All rendering has to go to framebuffer objects. With debugContext, the
+	* context is a debug context reporting GL errors synchronously, which is
+	* slow. Returns false on failure.
+	*/
+bool init_headless_EGL(bool debugContext = false);
+
 /**
 	* Updates things for the new frame to begin
 	*/
@@ -113,6 +125,7 @@ void processEvent( const SDL_Event* event );
 	* Destroys that which have been initialized.
 	*/
 void shutDown(SDL_Window* window);
+void shutDownHeadless();
 
 /**
 	 * Helper function: creates a cube map using the files specified for each face.
@@ -134,17 +147,103 @@ std::string GetShaderInfoLog(GLuint obj);
 	 * and attaches the shaders. Does NOT link the program, this is done with  linkShaderProgram()
 	 * The reason for this is that before linking we need to bind attribute locations, using
 	 * glBindAttribLocation and fragment data lications, using glBindFragDataLocation.
+	 * Lines of the form #include "file" are replaced with that file, relative to
+	 * the including shader.
+	 */
+GLuint loadShaderProgram(const std::string& vertexShader,
+                         const std::string& fragmentShader,
+                         bool allow_errors = false);
+
+/**
+	 * As above, with a geometry shader between the vertex and fragment shader.
+	 * An empty geometry shader filename leaves it out.
 	 */
 GLuint loadShaderProgram(const std::string& vertexShader,
+                         const std::string& geometryShader,
                          const std::string& fragmentShader,
                          bool allow_errors = false);
 
+/**
+	 * As above, with each of the defines ("NAME" or "NAME VALUE") #defined at
+	 * the top of every stage.
+	 */
+GLuint loadShaderProgram(const std::string& vertexShader,
+                         const std::string& geometryShader,
+                         const std::string& fragmentShader,
+                         const std::vector<std::string>& defines,
+                         bool allow_errors = false);
+
 GLuint loadComputeShaderProgram(const std::string& computeShader, bool allow_errors = false);
+GLuint loadComputeShaderProgram(const std::string& computeShader,
+                                const std::vector<std::string>& defines,
+                                bool allow_errors = false);
+
+/**
+	 * Keep the linked programs of the load functions above in this directory
+	 * (created when needed), and load them from there instead of compiling
+	 * when the sources, including defines and includes, and the driver are
+	 * the same. An empty directory, the default, turns this off.
+	 */
+void setProgramBinaryCacheDirectory(const std::string& directory);
+
+/**
+	 * A shader program compiled in variants, one per combination of features,
+	 * so that the shaders can #ifdef on the features instead of branching at
+	 * runtime. Feature bit i is enabled by defining featureDefines[i], and bits
+	 * without a name are ignored. Variants are compiled the first time they
+	 * are asked for. See labhelper::render() for picking them by material.
+	 */
+class ShaderPermutations
+{
+public:
+	/**
+		 * Sets the shaders and compiles the variant without features, which is
+		 * returned. On failure returns 0 and keeps the previous shaders.
+		 */
+	GLuint load(const std::string& vertexShader,
+	            const std::string& geometryShader,
+	            const std::string& fragmentShader,
+	            const std::vector<std::string>& featureDefines,
+	            bool allow_errors = false);
+	/**
+		 * The variant for a combination of features, compiled if needed. If
+		 * errors were allowed in load() and the variant fails to compile, the
+		 * variant of the previous shaders is used instead.
+		 */
+	GLuint getVariant(uint32_t features);
+	/**
+		 * The feature bits that select different variants
+		 */
+	uint32_t featureMask() const { return m_feature_mask; }
+
+private:
+	std::string m_vertex_shader;
+	std::string m_geometry_shader;
+	std::string m_fragment_shader;
+	std::vector<std::string> m_feature_defines;
+	uint32_t m_feature_mask = 0;
+	bool m_allow_errors = false;
+	std::unordered_map<uint32_t, GLuint> m_variants;
+	std::unordered_map<uint32_t, GLuint> m_previous_variants;
+};
 /**
 	 * Call to link a shader program prevoiusly loaded using loadShaderProgram.
 	 */
 bool linkShaderProgram(GLuint shaderProgram, bool allow_errors = false);
 
+/**
+	 * Returns the local work group size declared by a compute shader program.
+	 * It is queried once per program.
+	 */
+glm::uvec3 getComputeWorkGroupSize(GLuint computeShaderProgram);
+
+/**
+	 * Dispatches the currently bound compute shader program with enough work
+	 * groups to cover numInvocations invocations in each dimension. The shader
+	 * has to discard the invocations outside of the range itself.
+	 */
+void dispatchCompute(GLuint computeShaderProgram, const glm::uvec3& numInvocations);
+
 /**
 	 * Creates a GL buffer and uploads the given data to it.
 	 * returns the handle of the GL buffer.
@@ -172,6 +271,20 @@ void setUniformSlow(GLuint shaderProgram, const char* name, const bool value);
 void setUniformSlow(GLuint shaderProgram, const char* name, const glm::vec3& value);
 void setUniformSlow(GLuint shaderProgram, const char* name, const uint32_t nof_values, const glm::vec3* values);
 
+/**
+	 * Returns the location of a uniform in a program, or -1 if the program has
+	 * no such active uniform. The active uniforms of a program are looked up
+	 * once, the first time it is passed here, so this is much cheaper than
+	 * glGetUniformLocation(). Still, keep locations used in inner loops.
+	 */
+GLint getUniformLocation(GLuint shaderProgram, const std::string& name);
+
+/**
+	 * Deletes a shader program and forgets what is cached about it, since GL
+	 * may give its name to a new program. Use it instead of glDeleteProgram().
+	 */
+void deleteShaderProgram(GLuint shaderProgram);
+
 /**
 	* Helper to draw a single quad (two triangles) that cover the entire screen
 	*/
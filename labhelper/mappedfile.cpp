@@ -0,0 +1,130 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace labhelper
+{
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& filename)
+{
+	close();
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+	                          FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+	m_file = file;
+	m_size = size_t(size.QuadPart);
+	if(m_size == 0)
+	{
+		// Empty files can't be mapped, but are still valid
+		return true;
+	}
+	m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(m_mapping == nullptr)
+	{
+		close();
+		return false;
+	}
+	m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if(m_data == nullptr)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(m_data != nullptr)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if(m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+	}
+	if(m_file != nullptr)
+	{
+		CloseHandle(m_file);
+	}
+	m_data = nullptr;
+	m_mapping = nullptr;
+	m_file = nullptr;
+	m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string& filename)
+{
+	close();
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	m_fd = fd;
+	m_size = size_t(st.st_size);
+	if(m_size == 0)
+	{
+		// Empty files can't be mapped, but are still valid
+		return true;
+	}
+	void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	madvise(data, m_size, MADV_SEQUENTIAL);
+	m_data = static_cast<const char*>(data);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(m_data != nullptr)
+	{
+		munmap(const_cast<char*>(m_data), m_size);
+	}
+	if(m_fd >= 0)
+	{
+		::close(m_fd);
+	}
+	m_data = nullptr;
+	m_fd = -1;
+	m_size = 0;
+}
+
+#endif
+} // namespace labhelper
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////////
+// A read-only memory mapping of a whole file. The contents are NOT null
+// terminated, always use size().
+///////////////////////////////////////////////////////////////////////////////
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Maps the file, returns false if it could not be opened or mapped
+	bool open(const std::string& filename);
+	void close();
+
+	const char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#else
+	int m_fd = -1;
+#endif
+};
+} // namespace labhelper
@@ -0,0 +1,614 @@
+#include "objparser.h"
+#include "mappedfile.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace labhelper
+{
+namespace
+{
+///////////////////////////////////////////////////////////////////////////////
+// A face corner as read from the file: the vertex, texture coordinate and
+// normal index. Relative (negative) indices can only be resolved once the
+// number of elements in the preceding chunks is known, so until then they are
+// relative to the start of the chunk and flagged in `relative`.
+///////////////////////////////////////////////////////////////////////////////
+struct Corner
+{
+	int index[3];
+	uint8_t relative;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Everything but the vertex data is kept as a list of commands in file order,
+// to be replayed when the chunks are stitched together.
+///////////////////////////////////////////////////////////////////////////////
+struct Command
+{
+	enum Type : uint8_t
+	{
+		Face,
+		UseMaterial,
+		Group,
+		Object,
+		MaterialLibrary
+	};
+	Type type;
+	// The first corner of a face, or the index of the name
+	uint32_t first;
+	// The number of corners of a face
+	uint32_t count;
+};
+
+struct Chunk
+{
+	std::vector<float> vertices;
+	std::vector<float> normals;
+	std::vector<float> texcoords;
+	std::vector<Corner> corners;
+	std::vector<Command> commands;
+	std::vector<std::string> names;
+};
+
+// Chunks smaller than this are not worth a thread
+const size_t min_chunk_size = 256 * 1024;
+
+inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+inline bool isNewLine(char c)
+{
+	return c == '\r' || c == '\n' || c == '\0';
+}
+inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// One line of the file, which is not null terminated
+///////////////////////////////////////////////////////////////////////////////
+struct Line
+{
+	const char* p;
+	const char* end;
+
+	char peek(size_t offset = 0) const
+	{
+		return p + offset < end ? p[offset] : '\0';
+	}
+	bool startsWith(const char* str) const
+	{
+		size_t length = strlen(str);
+		return size_t(end - p) >= length && memcmp(p, str, length) == 0;
+	}
+	void skip(size_t n)
+	{
+		p = std::min(p + n, end);
+	}
+	void skipSpace()
+	{
+		while(p < end && isSpace(*p))
+			p++;
+	}
+	// The end of the token starting at p, i.e. the next space, tab or '\r'
+	const char* tokenEnd(bool stop_at_slash = false) const
+	{
+		const char* q = p;
+		while(q < end && !isSpace(*q) && *q != '\r' && !(stop_at_slash && *q == '/'))
+			q++;
+		return q;
+	}
+	std::string word()
+	{
+		skipSpace();
+		const char* begin = p;
+		p = tokenEnd();
+		return std::string(begin, p);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Mirrors tinyobj's tryParseDouble(), so that both give bit-exact the same
+// values, but stops at `end`.
+///////////////////////////////////////////////////////////////////////////////
+bool parseDouble(const char* p, const char* end, double* result)
+{
+	if(p >= end)
+		return false;
+	bool negative = false;
+	if(*p == '+' || *p == '-')
+	{
+		negative = *p == '-';
+		p++;
+	}
+	else if(!isDigit(*p))
+	{
+		return false;
+	}
+
+	double mantissa = 0.0;
+	int read = 0;
+	while(p < end && isDigit(*p))
+	{
+		mantissa = mantissa * 10 + int(*p - '0');
+		p++;
+		read++;
+	}
+	if(read == 0)
+		return false;
+
+	if(p < end && *p == '.')
+	{
+		static const double pow_lut[] = { 1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001 };
+		const int lut_entries = sizeof(pow_lut) / sizeof(pow_lut[0]);
+		p++;
+		for(read = 1; p < end && isDigit(*p); read++, p++)
+		{
+			mantissa += int(*p - '0') * (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
+		}
+	}
+
+	int exponent = 0;
+	if(p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negative_exponent = false;
+		if(p < end && (*p == '+' || *p == '-'))
+		{
+			negative_exponent = *p == '-';
+			p++;
+		}
+		else if(p >= end || !isDigit(*p))
+		{
+			return false;
+		}
+		read = 0;
+		while(p < end && isDigit(*p))
+		{
+			exponent = exponent * 10 + int(*p - '0');
+			p++;
+			read++;
+		}
+		if(negative_exponent)
+			exponent = -exponent;
+		if(read == 0)
+			return false;
+	}
+
+	*result = (negative ? -1 : 1) * (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+	return true;
+}
+
+float parseReal(Line& line)
+{
+	line.skipSpace();
+	const char* end = line.tokenEnd();
+	double value = 0.0;
+	parseDouble(line.p, end, &value);
+	line.p = end;
+	return float(value);
+}
+
+// Like atoi(), then skips to the next '/', space, tab or '\r'
+int parseIndex(Line& line)
+{
+	const char* p = line.p;
+	const char* end = line.tokenEnd(true);
+	bool negative = false;
+	if(p < end && (*p == '+' || *p == '-'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+	int value = 0;
+	while(p < end && isDigit(*p))
+	{
+		value = value * 10 + int(*p - '0');
+		p++;
+	}
+	line.p = end;
+	return negative ? -value : value;
+}
+
+void setIndex(Corner& corner, int i, int index, int count)
+{
+	if(index > 0)
+	{
+		corner.index[i] = index - 1;
+	}
+	else if(index == 0)
+	{
+		corner.index[i] = 0;
+	}
+	else
+	{
+		corner.index[i] = count + index;
+		corner.relative |= 1 << i;
+	}
+}
+
+// Parses v, v/vt, v//vn or v/vt/vn
+Corner parseCorner(Line& line, const Chunk& chunk)
+{
+	Corner corner = { { -1, -1, -1 }, 0 };
+	setIndex(corner, 0, parseIndex(line), int(chunk.vertices.size() / 3));
+	if(line.peek() != '/')
+		return corner;
+	line.skip(1);
+	if(line.peek() == '/')
+	{
+		line.skip(1);
+		setIndex(corner, 2, parseIndex(line), int(chunk.normals.size() / 3));
+		return corner;
+	}
+	setIndex(corner, 1, parseIndex(line), int(chunk.texcoords.size() / 2));
+	if(line.peek() != '/')
+		return corner;
+	line.skip(1);
+	setIndex(corner, 2, parseIndex(line), int(chunk.normals.size() / 3));
+	return corner;
+}
+
+void addName(Chunk& chunk, Command::Type type, const std::string& name)
+{
+	chunk.commands.push_back({ type, uint32_t(chunk.names.size()), 0 });
+	chunk.names.push_back(name);
+}
+
+void parseLine(Line line, Chunk& chunk)
+{
+	line.skipSpace();
+	const char c0 = line.peek(), c1 = line.peek(1), c2 = line.peek(2);
+	if(c0 == 'v' && isSpace(c1))
+	{
+		line.skip(2);
+		for(int i = 0; i < 3; i++)
+			chunk.vertices.push_back(parseReal(line));
+	}
+	else if(c0 == 'v' && c1 == 'n' && isSpace(c2))
+	{
+		line.skip(3);
+		for(int i = 0; i < 3; i++)
+			chunk.normals.push_back(parseReal(line));
+	}
+	else if(c0 == 'v' && c1 == 't' && isSpace(c2))
+	{
+		line.skip(3);
+		for(int i = 0; i < 2; i++)
+			chunk.texcoords.push_back(parseReal(line));
+	}
+	else if(c0 == 'f' && isSpace(c1))
+	{
+		line.skip(2);
+		line.skipSpace();
+		Command face = { Command::Face, uint32_t(chunk.corners.size()), 0 };
+		while(!isNewLine(line.peek()))
+		{
+			chunk.corners.push_back(parseCorner(line, chunk));
+			face.count++;
+			while(isSpace(line.peek()) || line.peek() == '\r')
+				line.skip(1);
+		}
+		chunk.commands.push_back(face);
+	}
+	else if(line.startsWith("usemtl") && isSpace(line.peek(6)))
+	{
+		line.skip(7);
+		addName(chunk, Command::UseMaterial, line.word());
+	}
+	else if(line.startsWith("mtllib") && isSpace(line.peek(6)))
+	{
+		line.skip(7);
+		addName(chunk, Command::MaterialLibrary, std::string(line.p, line.end));
+	}
+	else if(c0 == 'g' && isSpace(c1))
+	{
+		line.skip(1);
+		addName(chunk, Command::Group, line.word());
+	}
+	else if(c0 == 'o' && isSpace(c1))
+	{
+		line.skip(2);
+		addName(chunk, Command::Object, line.word());
+	}
+	// Comments and everything else are ignored
+}
+
+void parseChunk(const char* begin, const char* end, Chunk& chunk)
+{
+	for(const char* p = begin; p < end;)
+	{
+		const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+		if(line_end == nullptr)
+			line_end = end;
+		const char* content_end = line_end;
+		if(content_end > p && content_end[-1] == '\r')
+			content_end--;
+		parseLine({ p, content_end }, chunk);
+		p = line_end + 1;
+	}
+}
+
+// Makes the chunk's relative indices absolute, given the number of elements
+// before it, and copies its vertex data to where it goes in the whole file
+void resolveChunk(Chunk& chunk, const int first[3], tinyobj::attrib_t* attrib)
+{
+	std::copy(chunk.vertices.begin(), chunk.vertices.end(), attrib->vertices.begin() + size_t(first[0]) * 3);
+	std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), attrib->texcoords.begin() + size_t(first[1]) * 2);
+	std::copy(chunk.normals.begin(), chunk.normals.end(), attrib->normals.begin() + size_t(first[2]) * 3);
+	for(Corner& corner : chunk.corners)
+	{
+		for(int i = 0; i < 3; i++)
+		{
+			if(corner.relative & (1 << i))
+				corner.index[i] += first[i];
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Worker threads that are started once and then kept, so that loading several
+// models doesn't pay for starting threads every time. Grows to the largest
+// number of threads asked for.
+///////////////////////////////////////////////////////////////////////////////
+class WorkerPool
+{
+public:
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_work.notify_all();
+		for(auto& thread : m_threads)
+		{
+			thread.join();
+		}
+	}
+
+	// Runs f(0), ..., f(count - 1) in parallel, f(0) on the calling thread,
+	// and waits for them
+	void run(size_t count, const std::function<void(size_t)>& f)
+	{
+		if(count <= 1)
+		{
+			if(count == 1)
+				f(0);
+			return;
+		}
+		std::lock_guard<std::mutex> run_lock(m_run_mutex);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			while(m_threads.size() < count - 1)
+			{
+				m_threads.emplace_back(&WorkerPool::work, this);
+			}
+			m_job = &f;
+			m_job_count = count;
+			m_next_index = 1;
+			m_remaining = count - 1;
+		}
+		m_work.notify_all();
+		f(0);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this] { return m_remaining == 0; });
+		m_job = nullptr;
+	}
+
+private:
+	void work()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for(;;)
+		{
+			m_work.wait(lock, [this] { return m_stop || (m_job != nullptr && m_next_index < m_job_count); });
+			if(m_stop)
+				return;
+			size_t index = m_next_index++;
+			const std::function<void(size_t)>& f = *m_job;
+			lock.unlock();
+			f(index);
+			lock.lock();
+			if(--m_remaining == 0)
+				m_done.notify_one();
+		}
+	}
+
+	// Serializes run() calls from different threads
+	std::mutex m_run_mutex;
+	std::mutex m_mutex;
+	std::condition_variable m_work;
+	std::condition_variable m_done;
+	std::vector<std::thread> m_threads;
+	const std::function<void(size_t)>* m_job = nullptr;
+	size_t m_job_count = 0;
+	size_t m_next_index = 0;
+	size_t m_remaining = 0;
+	bool m_stop = false;
+};
+
+// Runs f(0), ..., f(count - 1) on the worker pool, and waits for them. A file
+// that fits in one chunk is parsed on the calling thread alone.
+void runOnThreads(size_t count, const std::function<void(size_t)>& f)
+{
+	static WorkerPool pool;
+	pool.run(count, f);
+}
+
+tinyobj::index_t toIndex(const Corner& corner)
+{
+	tinyobj::index_t index;
+	index.vertex_index = corner.index[0];
+	index.texcoord_index = corner.index[1];
+	index.normal_index = corner.index[2];
+	return index;
+}
+} // namespace
+
+bool parseOBJ(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+              std::vector<tinyobj::material_t>* materials, std::string* err, const std::string& filename,
+              const std::string& mtl_basedir)
+{
+	attrib->vertices.clear();
+	attrib->normals.clear();
+	attrib->texcoords.clear();
+	shapes->clear();
+	materials->clear();
+
+	MappedFile file;
+	if(!file.open(filename))
+	{
+		if(err)
+		{
+			(*err) += "Cannot open file [" + filename + "]\n";
+		}
+		return false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Split the file into chunks of whole lines and parse them in parallel
+	///////////////////////////////////////////////////////////////////////////
+	const char* data = file.data();
+	const size_t size = file.size();
+	size_t num_chunks = std::max<size_t>(1, std::thread::hardware_concurrency());
+	num_chunks = std::max<size_t>(1, std::min(num_chunks, size / min_chunk_size));
+	std::vector<size_t> chunk_starts(num_chunks + 1, size);
+	chunk_starts[0] = 0;
+	for(size_t i = 1; i < num_chunks; i++)
+	{
+		size_t start = std::max(chunk_starts[i - 1], size / num_chunks * i);
+		const char* newline = static_cast<const char*>(memchr(data + start, '\n', size - start));
+		chunk_starts[i] = newline != nullptr ? size_t(newline - data) + 1 : size;
+	}
+	std::vector<Chunk> chunks(num_chunks);
+	runOnThreads(num_chunks, [&](size_t i) {
+		parseChunk(data + chunk_starts[i], data + chunk_starts[i + 1], chunks[i]);
+	});
+	file.close();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Place each chunk's vertex data after that of the previous chunks
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<int> first(3 * (num_chunks + 1), 0);
+	for(size_t i = 0; i < num_chunks; i++)
+	{
+		first[3 * (i + 1) + 0] = first[3 * i + 0] + int(chunks[i].vertices.size() / 3);
+		first[3 * (i + 1) + 1] = first[3 * i + 1] + int(chunks[i].texcoords.size() / 2);
+		first[3 * (i + 1) + 2] = first[3 * i + 2] + int(chunks[i].normals.size() / 3);
+	}
+	attrib->vertices.resize(size_t(first[3 * num_chunks + 0]) * 3);
+	attrib->texcoords.resize(size_t(first[3 * num_chunks + 1]) * 2);
+	attrib->normals.resize(size_t(first[3 * num_chunks + 2]) * 3);
+	runOnThreads(num_chunks, [&](size_t i) { resolveChunk(chunks[i], &first[3 * i], attrib); });
+
+	///////////////////////////////////////////////////////////////////////////
+	// Replay the commands in file order to build the shapes. This is the same
+	// state machine as in tinyobj::LoadObj(), with the faces triangulated as
+	// they are added since a group of faces always gets the material that was
+	// active when they were read.
+	///////////////////////////////////////////////////////////////////////////
+	std::map<std::string, int> material_map;
+	tinyobj::MaterialFileReader read_materials(mtl_basedir);
+	tinyobj::shape_t shape;
+	std::string name;
+	int material = -1;
+	size_t pending_faces = 0;
+	auto finishFaces = [&]() {
+		if(pending_faces == 0)
+			return false;
+		shape.name = name;
+		pending_faces = 0;
+		return true;
+	};
+	for(const Chunk& chunk : chunks)
+	{
+		for(const Command& command : chunk.commands)
+		{
+			switch(command.type)
+			{
+			case Command::Face:
+			{
+				const Corner* corners = &chunk.corners[command.first];
+				for(uint32_t k = 2; k < command.count; k++)
+				{
+					shape.mesh.indices.push_back(toIndex(corners[0]));
+					shape.mesh.indices.push_back(toIndex(corners[k - 1]));
+					shape.mesh.indices.push_back(toIndex(corners[k]));
+					shape.mesh.num_face_vertices.push_back(3);
+					shape.mesh.material_ids.push_back(material);
+				}
+				pending_faces++;
+				break;
+			}
+			case Command::UseMaterial:
+			{
+				auto it = material_map.find(chunk.names[command.first]);
+				int new_material = it != material_map.end() ? it->second : -1;
+				if(new_material != material)
+				{
+					finishFaces();
+					material = new_material;
+				}
+				break;
+			}
+			case Command::Group:
+			case Command::Object:
+				if(finishFaces())
+				{
+					shapes->push_back(shape);
+				}
+				shape = tinyobj::shape_t();
+				name = chunk.names[command.first];
+				break;
+			case Command::MaterialLibrary:
+			{
+				// Space separated alternatives, the first one found is used
+				const std::string& line = chunk.names[command.first];
+				std::vector<std::string> libraries;
+				for(size_t start = 0; start < line.size();)
+				{
+					size_t end = std::min(line.find(' ', start), line.size());
+					libraries.push_back(line.substr(start, end - start));
+					start = end + 1;
+				}
+				bool found = false;
+				for(const std::string& library : libraries)
+				{
+					std::string err_mtl;
+					found = read_materials(library, materials, &material_map, &err_mtl);
+					if(err)
+					{
+						(*err) += err_mtl;
+					}
+					if(found)
+						break;
+				}
+				if(err && libraries.empty())
+				{
+					(*err) += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+				}
+				else if(err && !found)
+				{
+					(*err) += "WARN: Failed to load material file(s). Use default material.\n";
+				}
+				break;
+			}
+			}
+		}
+	}
+	if(finishFaces() || !shape.mesh.indices.empty())
+	{
+		shapes->push_back(shape);
+	}
+	return true;
+}
+} // namespace labhelper
@@ -0,0 +1,20 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+
+namespace labhelper
+{
+///////////////////////////////////////////////////////////////////////////////
+// Parses an OBJ file into the same data as
+// tinyobj::LoadObj(attrib, shapes, materials, err, filename, mtl_basedir, true)
+// would, i.e. with the faces triangulated. The file is memory mapped and split
+// into chunks of whole lines that are parsed on all hardware threads, which are
+// kept between calls, after which the chunks are stitched together in file
+// order. Tags ('t') are not supported. Returns false if the file could not be
+// read.
+///////////////////////////////////////////////////////////////////////////////
+bool parseOBJ(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+              std::vector<tinyobj::material_t>* materials, std::string* err, const std::string& filename,
+              const std::string& mtl_basedir);
+} // namespace labhelper
@@ -5,6 +5,7 @@
 #include <imgui.h>
 
 #include <unordered_map>
+#include <map>
 #include <vector>
 
 #include <sstream>
@@ -80,6 +81,8 @@ std::unordered_map<std::string, std::vector<time_event_durations_t>> time_record
 
 timestamp_t last_frame_time = {};
 
+std::map<std::string, float> statistics;
+
 
 timestamp_t getTimestamp() { return std::chrono::high_resolution_clock::now(); }
 
@@ -315,6 +318,11 @@ void record_events()
 }   // namespace
 
 
+void setStatistic( const std::string& name, float value )
+{
+	statistics[name] = value;
+}
+
 void drawEventsWindow()
 {
 	if ( event_stack.size() == 1 && event_stack[0].name == "Frame" )
@@ -430,6 +438,26 @@ void drawEventsWindow()
 			ImGui::EndTable();
 		}
 
+		if ( !statistics.empty() && ImGui::BeginTable( "statistics", 2, ImGuiTableFlags_RowBg ) )
+		{
+			ImGuiTableColumnFlags flags =
+				ImGuiTableColumnFlags_NoHide | ImGuiTableColumnFlags_NoSort;
+			ImGui::TableSetupColumn( "Statistic", flags | ImGuiTableColumnFlags_WidthStretch );
+			ImGui::TableSetupColumn( "   Value", flags | ImGuiTableColumnFlags_WidthFixed, 100 );
+			ImGui::TableHeadersRow();
+
+			for ( const auto& statistic : statistics )
+			{
+				ImGui::TableNextRow();
+				ImGui::TableNextColumn();
+				ImGui::TextUnformatted( statistic.first.c_str() );
+				ImGui::TableNextColumn();
+				ImGui::Text( "% 10.4f", statistic.second );
+			}
+
+			ImGui::EndTable();
+		}
+
 #if USE_FMT
 		if ( copy_text )
 		{
@@ -15,6 +15,10 @@ void synchProfilers();
 
 void drawEventsWindow();
 
+// Sets a named value that is listed below the timings until it is set again,
+// e.g. statistics gathered while loading
+void setStatistic( const std::string& name, float value );
+
 struct Scope
 {
 public:
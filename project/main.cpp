@@ -7,6 +7,7 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 #include <cstdlib>
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 
 #include <labhelper.h>
 #include <imgui.h>
@@ -40,13 +41,20 @@ bool g_isMouseDragging = false;
 // Toggle for rendering which texture
 bool renderOriginalPerturbed = true;
 bool renderImageTexture = false;
+// Debug wireframe of the displayed sphere, drawn over the preview
+bool showWireframeOverlay = false;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Shader programs
 ///////////////////////////////////////////////////////////////////////////////
-GLuint shaderProgram;       // Shader for rendering the final image
+// The shading shaders, specialized for the textures of each material
+labhelper::ShaderPermutations shadingShaders; // Shader for rendering the final image
 GLuint simpleShaderProgram; // Shader used to draw the shadow map
 GLuint fullScreenQuadShaderProgram; // Shader for rendering the full screen quad
+labhelper::ShaderPermutations batchedShaders; // Shader for rendering all perturbations of a batch in one draw
+
+// The defines shading.frag is specialized on, by bit of Material::textureMask()
+const std::vector<std::string> shadingFeatureDefines = { "", "", "", "", "", "HAS_EMISSION_TEXTURE" };
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
@@ -62,6 +70,27 @@ vec3 point_light_color = vec3(1.f, 1.f, 1.f);
 
 float point_light_intensity_multiplier = 10000.0f;
 
+///////////////////////////////////////////////////////////////////////////////
+// Camera and light uniforms, in the std140 layout of scene_uniforms.glsl.
+// Uploaded by drawScene() only when they change.
+///////////////////////////////////////////////////////////////////////////////
+struct SceneUniforms
+{
+	mat4 viewInverse;
+	mat4 modelViewMatrix;
+	mat4 modelViewProjectionMatrix;
+	mat4 normalMatrix;
+	vec3 viewSpaceLightPosition;
+	float point_light_intensity_multiplier;
+	vec3 viewSpaceLightDir;
+	float environment_multiplier;
+	vec3 point_light_color;
+	float padding;
+};
+static_assert(sizeof(SceneUniforms) == 4 * 64 + 3 * 16, "SceneUniforms must match the std140 layout");
+GLuint sceneUniformBuffer;
+SceneUniforms uploadedSceneUniforms;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
@@ -83,15 +112,59 @@ mat4 roomModelMatrix;
 ///////////////////////////////////////////////////////////////////////////////
 // Compute shaders
 ///////////////////////////////////////////////////////////////////////////////
-GLuint originalVertexInputSSBO;
+// The vertex positions being optimized, welded so that the copies of a vertex
+// split on UV or normal seams are one parameter. perturb.comp scatters them to
+// the render vertices. update.comp reads the current state
+// and writes the next one into the following buffer of this ring, so nothing
+// is copied per step, and the previous parameterHistorySize - 1 states stay
+// around for rolling back. Two buffers make plain ping-ponging.
+const int maxParameterHistorySize = 16;
+int parameterHistorySize = 2;
+GLuint parameterSSBOs[maxParameterHistorySize];
+int currentParameterState = 0;
+int numRollbackStates = 0; // How many of the previous states are valid
 GLuint perturbedOutputSSBO;
 GLuint perturbedOppositeOutputSSBO;
+GLuint perturbedNormalSSBO;         // Vertex normals recomputed for the perturbed positions
+GLuint perturbedOppositeNormalSSBO; // and for the oppositely perturbed positions
+GLuint groupErrorSSBO; // Per work group error sums, sized to the FBOs
+GLuint errorSSBO;      // Total error of the positively and negatively perturbed render
 GLuint computeShaderProgram;
+GLuint normalShaderProgram;
+GLuint pixelErrorShaderProgram;
+GLuint reduceErrorShaderProgram;
+GLuint batchedPixelErrorShaderProgram;
+GLuint updateShaderProgram;
 
 float perturbMag = 0.01f;
+float learningRate = 0.1f;
 bool perturb = false;
 bool perturbOnce = true;
 bool hasBeenPerturbed = false;
+uint32_t iteration = 0; // Number of optimization steps taken, seeds the perturbations
+
+// Scheduling of the optimization against the displayed frames. Each frame runs
+// either a fixed number of iterations or as many as fit in a time budget, and
+// only every previewInterval:th frame is actually rendered and presented.
+int iterationsPerFrame = 1;
+bool useIterationTimeBudget = false;
+float iterationTimeBudgetMs = 12.0f;
+int previewInterval = 1;
+float iterationsPerSecond = 0.0f; // Measured, for the GUI
+
+// In batched mode every iteration evaluates several independent antithetic
+// perturbation pairs and averages their gradient estimates
+bool batchedPerturbation = false;
+// Render the positive and negative perturbation with a single draw into two
+// layers of batchedPerturbedFBO, rather than with one draw into each of
+// posPerturbedFBO and negPerturbedFBO. Batched mode always does this.
+bool singlePassPerturbation = true;
+// The layered draws read the perturbed positions and normals from four shader
+// storage buffers in perturbed.vert, which GL 4.3 doesn't guarantee for vertex
+// shaders. Without them only the two pass, single pair path is available.
+bool layeredPerturbationSupported = true;
+int numPerturbationPairs = 4;
+const int maxPerturbationPairs = 16;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Framebuffer Objects
@@ -99,6 +172,7 @@ bool hasBeenPerturbed = false;
 FboInfo* posPerturbedFBO = nullptr; // FBO for original perturbed sphere
 FboInfo* negPerturbedFBO = nullptr; // FBO for oppositely perturbed sphere
 FboInfo* inputImageFBO = nullptr; // FBO for input image
+FboInfo* batchedPerturbedFBO = nullptr; // Layered FBO with both perturbations of every pair in a batch
 
 // Temporary texture to hold the loaded image from file before rendering it to inputImageFBO
 GLuint loadedImageTempTextureId = 0; 
@@ -138,16 +212,42 @@ void loadShaders(bool is_reload)
 		simpleShaderProgram = shader;
 	}
 
-	shader = labhelper::loadShaderProgram("../project/shading.vert", "../project/shading.frag", is_reload);
+	shadingShaders.load("../project/shading.vert", "", "../project/shading.frag", shadingFeatureDefines, is_reload);
+
+	shader = labhelper::loadComputeShaderProgram("../project/perturb.comp", is_reload);
 	if(shader != 0)
 	{
-		shaderProgram = shader;
+		computeShaderProgram = shader;
 	}
 
-	shader = labhelper::loadComputeShaderProgram("../project/perturb.comp", is_reload);
+	shader = labhelper::loadComputeShaderProgram("../project/normals.comp", is_reload);
 	if(shader != 0)
 	{
-		computeShaderProgram = shader;
+		normalShaderProgram = shader;
+	}
+
+	shader = labhelper::loadComputeShaderProgram("../project/pixel_error.comp", is_reload);
+	if(shader != 0)
+	{
+		pixelErrorShaderProgram = shader;
+	}
+
+	shader = labhelper::loadComputeShaderProgram("../project/pixel_error_layered.comp", is_reload);
+	if(shader != 0)
+	{
+		batchedPixelErrorShaderProgram = shader;
+	}
+
+	shader = labhelper::loadComputeShaderProgram("../project/reduce_error.comp", is_reload);
+	if(shader != 0)
+	{
+		reduceErrorShaderProgram = shader;
+	}
+
+	shader = labhelper::loadComputeShaderProgram("../project/update.comp", is_reload);
+	if(shader != 0)
+	{
+		updateShaderProgram = shader;
 	}
 
     shader = labhelper::loadShaderProgram("../project/fullscreenquad.vert", "../project/fullscreenquad.frag", is_reload);
@@ -155,9 +255,123 @@ void loadShaders(bool is_reload)
     {
         fullScreenQuadShaderProgram = shader;
     }
+
+	if(!layeredPerturbationSupported)
+	{
+		return;
+	}
+	// Without a layer extension the vertex shader can't route the instances to
+	// their layers, and a geometry shader has to do it
+	bool vertexShaderLayer = GLEW_ARB_shader_viewport_layer_array || GLEW_AMD_vertex_shader_layer;
+	batchedShaders.load("../project/perturbed.vert", vertexShaderLayer ? "" : "../project/perturbed_layer.geom",
+	                    "../project/shading.frag", shadingFeatureDefines, is_reload);
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+/// Vertex positions and perturbation directions are shared with the shaders as
+/// tightly packed vec3s, three floats per vertex (see packed_positions.glsl).
+///////////////////////////////////////////////////////////////////////////////
+static_assert(sizeof(vec3) == 3 * sizeof(float), "Vertex positions must be tightly packed");
+
+///////////////////////////////////////////////////////////////////////////////
+/// Checks that a buffer has exactly the size the shaders derive their vertex
+/// counts from, since a mismatch silently reads or writes the wrong vertices
+///////////////////////////////////////////////////////////////////////////////
+void validateBufferSize(GLuint buffer, size_t expectedSize, const std::string& name)
+{
+	GLint64 size = 0;
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	glGetBufferParameteri64v(GL_COPY_READ_BUFFER, GL_BUFFER_SIZE, &size);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	if(size != GLint64(expectedSize))
+	{
+		labhelper::fatal_error(name + " is " + std::to_string(size) + " bytes, expected "
+		                           + std::to_string(expectedSize),
+		                       "Buffer size");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// (Re)allocates the buffers holding numPerturbationPairs perturbations of the
+/// sphere. The first pair is initialized to the loaded positions and normals.
+///////////////////////////////////////////////////////////////////////////////
+void allocatePerturbationBuffers()
+{
+	size_t numVertices = sphereModel->m_positions.size();
+	size_t numParameters = sphereModel->m_welded_positions.size();
+	size_t size = numPerturbationPairs * numVertices * sizeof(vec3);
+
+	for(GLuint buffer : { perturbedOutputSSBO, perturbedOppositeOutputSSBO })
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_COPY_READ_BUFFER, sphereModel->m_positions_bo);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, numVertices * sizeof(vec3));
+	}
+	// m_normals_bo is compact, so the normals are uploaded from the CPU copy
+	for(GLuint buffer : { perturbedNormalSSBO, perturbedOppositeNormalSSBO })
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_DYNAMIC_COPY);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, 0, numVertices * sizeof(vec3), sphereModel->m_normals.data());
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, errorSSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numPerturbationPairs * sizeof(vec2), nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	for(int i = 0; i < parameterHistorySize; i++)
+	{
+		validateBufferSize(parameterSSBOs[i], numParameters * sizeof(vec3), "Vertex parameters");
+	}
+	validateBufferSize(perturbedOutputSSBO, size, "Perturbed positions");
+	validateBufferSize(perturbedOppositeOutputSSBO, size, "Oppositely perturbed positions");
+	validateBufferSize(perturbedNormalSSBO, size, "Perturbed normals");
+	validateBufferSize(perturbedOppositeNormalSSBO, size, "Oppositely perturbed normals");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Number of pixel_error.comp work groups needed to cover the FBOs. The
+/// layered variant has the same work group size.
+///////////////////////////////////////////////////////////////////////////////
+ivec2 pixelErrorGroupCount()
+{
+	uvec3 groupSize = labhelper::getComputeWorkGroupSize(pixelErrorShaderProgram);
+	return ivec2((windowWidth + groupSize.x - 1) / groupSize.x, (windowHeight + groupSize.y - 1) / groupSize.y);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// (Re)allocates the per work group error sums, after the FBOs have been
+/// resized or the number of perturbation pairs has changed
+///////////////////////////////////////////////////////////////////////////////
+void allocateGroupErrorBuffer()
+{
+	ivec2 numGroups = pixelErrorGroupCount();
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, groupErrorSSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numPerturbationPairs * numGroups.x * numGroups.y * sizeof(vec2),
+	             nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Number of perturbation pairs evaluated by one optimization step
+///////////////////////////////////////////////////////////////////////////////
+int activePerturbationPairs()
+{
+	return batchedPerturbation ? numPerturbationPairs : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Whether the optimization renders into the layers of batchedPerturbedFBO
+///////////////////////////////////////////////////////////////////////////////
+bool layeredPerturbation()
+{
+	return batchedPerturbation || singlePassPerturbation;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// This function is called once at the start of the program and never again
 ///////////////////////////////////////////////////////////////////////////////
@@ -165,47 +379,88 @@ void initialize()
 {
 	ENSURE_INITIALIZE_ONLY_ONCE();
 
+	GLint maxVertexStorageBlocks = 0;
+	glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &maxVertexStorageBlocks);
+	if(maxVertexStorageBlocks < 4)
+	{
+		printf("Vertex shaders have %d storage blocks, layered perturbation needs 4\n", maxVertexStorageBlocks);
+		layeredPerturbationSupported = false;
+		batchedPerturbation = false;
+		singlePassPerturbation = false;
+	}
+
 	///////////////////////////////////////////////////////////////////////
 	//		Load Shaders
 	///////////////////////////////////////////////////////////////////////
 	loadShaders(false);
 
+	glGenBuffers(1, &sceneUniformBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, sceneUniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(SceneUniforms), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	memset(&uploadedSceneUniforms, 0, sizeof(SceneUniforms));
+
 	///////////////////////////////////////////////////////////////////////
 	// Load models and set up model matrices
 	///////////////////////////////////////////////////////////////////////
-	sphereModel = labhelper::loadModelFromOBJ("../scenes/sphere.obj");
-    sphereModelPerturbedOpposite = labhelper::loadModelFromOBJ("../scenes/sphere.obj");
+	// The adjacency is needed for recomputing the normals on the GPU, and the
+	// welded positions are the parameters of the optimization. The sphere is
+	// drawn several times per iteration, so it is worth optimizing its order
+	// and fetching less per vertex. Optimizing it is what the mesh cache saves.
+	labhelper::ModelLoadOptions loadOptions;
+	loadOptions.build_adjacency = true;
+	loadOptions.weld_positions = true;
+	loadOptions.optimize_vertex_cache = true;
+	loadOptions.optimize_overdraw = true;
+	loadOptions.compact_vertices = true;
+	loadOptions.interleave_static_attributes = true;
+	loadOptions.dynamic_positions = true;
+	loadOptions.use_mesh_cache = true;
+	sphereModel = labhelper::loadModelFromOBJ("../scenes/sphere.obj", loadOptions);
+	// The oppositely perturbed sphere only differs in its positions
+	sphereModelPerturbedOpposite = labhelper::createModelInstance(sphereModel);
 
 	vec3 initialSphereCenter = cameraPosition + cameraDirection * 100.0f;
     lightPosition = initialSphereCenter + vec3(0.0f, 20.0f, 0.0f); 
 
 	roomModelMatrix = mat4(1.0f);
 
-	// Create and bind SSBO for original vertex positions (input to compute shader)
-	glGenBuffers(1, &originalVertexInputSSBO);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, originalVertexInputSSBO);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sphereModel->m_positions.size() * sizeof(vec3),
-			  sphereModel->m_positions.data(), GL_STATIC_DRAW);
+	// Create the ring of SSBOs for the vertex positions being optimized (input
+	// to the compute shaders). The first one starts at the loaded positions.
+	glGenBuffers(parameterHistorySize, parameterSSBOs);
+	for(int i = 0; i < parameterHistorySize; i++)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, parameterSSBOs[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sphereModel->m_welded_positions.size() * sizeof(vec3),
+		             i == 0 ? sphereModel->m_welded_positions.data() : nullptr, GL_DYNAMIC_COPY);
+	}
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-	// Create and bind SSBO for positively perturbed vertex positions (output from compute shader)
+	// Create SSBOs for the positively and negatively perturbed vertex positions
+	// (outputs from compute shader) and their normals, and the pixel error.
+	// They hold one entry per perturbation pair and are sized by
+	// allocatePerturbationBuffers(). The per
+	// work group error buffer is allocated when the FBOs are resized.
 	glGenBuffers(1, &perturbedOutputSSBO);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOutputSSBO);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sphereModel->m_positions.size() * sizeof(vec3),
-			  sphereModel->m_positions.data(), GL_DYNAMIC_COPY);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-
-	// Create and bind SSBO for oppositely perturbed vertex positions (output from compute shader)
 	glGenBuffers(1, &perturbedOppositeOutputSSBO);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOppositeOutputSSBO);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sphereModelPerturbedOpposite->m_positions.size() * sizeof(vec3),
-			  sphereModelPerturbedOpposite->m_positions.data(), GL_DYNAMIC_COPY);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glGenBuffers(1, &perturbedNormalSSBO);
+	glGenBuffers(1, &perturbedOppositeNormalSSBO);
+	glGenBuffers(1, &errorSSBO);
+	glGenBuffers(1, &groupErrorSSBO);
+	allocatePerturbationBuffers();
+
+	// Let the two spheres source their positions straight from the compute shader
+	// outputs, so a perturbation never has to be read back to the CPU.
+	labhelper::bindPositionBuffer(sphereModel, perturbedOutputSSBO);
+	labhelper::bindPositionBuffer(sphereModelPerturbedOpposite, perturbedOppositeOutputSSBO);
+	labhelper::bindNormalBuffer(sphereModel, perturbedNormalSSBO);
+	labhelper::bindNormalBuffer(sphereModelPerturbedOpposite, perturbedOppositeNormalSSBO);
 
     // Initialize FBOs
     posPerturbedFBO = new FboInfo();
     negPerturbedFBO = new FboInfo();
 	inputImageFBO = new FboInfo();
+	batchedPerturbedFBO = new FboInfo(1, 2 * numPerturbationPairs);
 
 	// Load the image into a temporary texture. It will be rendered to inputImageFBO later.
 	loadedImageTempTextureId = loadImageAsTexture("../scenes/tvTestCard.jpg");
@@ -216,95 +471,350 @@ void initialize()
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+/// Recomputes the normals of both perturbed spheres of every active pair, so
+/// the shading (and with it the pixel error) follows the perturbed geometry
+///////////////////////////////////////////////////////////////////////////////
+void recomputeNormals()
+{
+	glUseProgram(normalShaderProgram);
+	GLuint numVertices = GLuint(sphereModel->m_positions.size());
+	glUniform1ui(glGetUniformLocation(normalShaderProgram, "numVertices"), numVertices);
+	glUniform1ui(glGetUniformLocation(normalShaderProgram, "numSamples"), activePerturbationPairs());
+	glUniform1i(glGetUniformLocation(normalShaderProgram, "shortIndices"), sphereModel->m_index_size == sizeof(uint16_t));
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sphereModel->m_indices_bo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sphereModel->m_vertex_face_offsets_bo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, sphereModel->m_vertex_faces_bo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, sphereModel->m_welded_position_indices_bo);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, perturbedOutputSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, perturbedNormalSSBO);
+	labhelper::dispatchCompute(normalShaderProgram, uvec3(numVertices, activePerturbationPairs(), 1));
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, perturbedOppositeOutputSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, perturbedOppositeNormalSSBO);
+	labhelper::dispatchCompute(normalShaderProgram, uvec3(numVertices, activePerturbationPairs(), 1));
+}
+
 void perturbVertices() {
 	glUseProgram(computeShaderProgram);
 
-	// For some reason the labhelper version doesn't work??
-	//labhelper::setUniformSlow(shaderProgram, "currentTime", currentTime);
-    glUniform1f(glGetUniformLocation(computeShaderProgram, "currentTime"), currentTime);
+	glUniform1ui(glGetUniformLocation(computeShaderProgram, "iteration"), iteration);
 	glUniform1f(glGetUniformLocation(computeShaderProgram, "perturbMag"), perturbMag);
+	glUniform1ui(glGetUniformLocation(computeShaderProgram, "numSamples"), activePerturbationPairs());
 
 	size_t numVertices = sphereModel->m_positions.size();
 
 	// Bind the original vertex data as input
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, originalVertexInputSSBO);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, originalVertexInputSSBO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, parameterSSBOs[currentParameterState]);
 
     // Bind the output buffers
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOutputSSBO);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, perturbedOutputSSBO);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOppositeOutputSSBO);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, perturbedOppositeOutputSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, sphereModel->m_welded_position_indices_bo);
 
-	glDispatchCompute(numVertices, 1, 1);
-
+	labhelper::dispatchCompute(computeShaderProgram, uvec3(numVertices, activePerturbationPairs(), 1));
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-	// Read back modified vertex data for the first sphere (positively perturbed)
-	std::vector<vec3> updatedPositions(sphereModel->m_positions.size());
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOutputSSBO);
-	void* ptr = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
-	memcpy(updatedPositions.data(), ptr, updatedPositions.size() * sizeof(vec3));
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	recomputeNormals();
 
-	glBindBuffer(GL_ARRAY_BUFFER, sphereModel->m_positions_bo);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, updatedPositions.size() * sizeof(vec3), updatedPositions.data());
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Read back modified vertex data for the second sphere (negatively perturbed)
-    std::vector<vec3> updatedPositionsOpposite(sphereModelPerturbedOpposite->m_positions.size());
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOppositeOutputSSBO);
-    ptr = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
-    memcpy(updatedPositionsOpposite.data(), ptr, updatedPositionsOpposite.size() * sizeof(vec3));
-    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, sphereModelPerturbedOpposite->m_positions_bo);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, updatedPositionsOpposite.size() * sizeof(vec3), updatedPositionsOpposite.data());
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-
-	// TODO probably change this stuff to work with the error from the paper?
-	glBindBuffer(GL_COPY_READ_BUFFER, perturbedOutputSSBO); // Source buffer
-	glBindBuffer(GL_COPY_WRITE_BUFFER, originalVertexInputSSBO); // Destination buffer
-	
-	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sphereModel->m_positions.size() * sizeof(vec3));
-	
-	glBindBuffer(GL_COPY_READ_BUFFER, 0);
-	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	// The outputs are read as vertex attributes by the two sphere VAOs or from
+	// the batched vertex shader, and the directions by the update step.
+	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 /// This function is used to draw the main objects on the scene
 ///////////////////////////////////////////////////////////////////////////////
-void drawScene(GLuint currentShaderProgram,
+void drawScene(labhelper::ShaderPermutations& shaders,
                const mat4& viewMatrix,
                const mat4& projectionMatrix,
-               labhelper::Model* modelToRender)
+               labhelper::Model* modelToRender,
+               int numInstances = 1)
 {
-	glUseProgram(currentShaderProgram);
-	// Light source
-	vec4 viewSpaceLightPosition = viewMatrix * vec4(lightPosition, 1.0f);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_color", point_light_color);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_intensity_multiplier",
-	                          point_light_intensity_multiplier);
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightPosition", vec3(viewSpaceLightPosition));
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightDir",
-	                          normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
-
+	mat4 modelMatrix = glm::translate(vec3(0.0f, 0.0f, -7.0f));
+	mat4 modelViewMatrix = viewMatrix * modelMatrix;
 
+	SceneUniforms uniforms;
+	memset(&uniforms, 0, sizeof(SceneUniforms));
+	// Light source
+	uniforms.viewSpaceLightPosition = vec3(viewMatrix * vec4(lightPosition, 1.0f));
+	uniforms.viewSpaceLightDir = normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f)));
+	uniforms.point_light_color = point_light_color;
+	uniforms.point_light_intensity_multiplier = point_light_intensity_multiplier;
 	// Environment
-	labhelper::setUniformSlow(currentShaderProgram, "environment_multiplier", environment_multiplier);
+	uniforms.environment_multiplier = environment_multiplier;
+	// Camera and model
+	uniforms.viewInverse = inverse(viewMatrix);
+	uniforms.modelViewMatrix = modelViewMatrix;
+	uniforms.modelViewProjectionMatrix = projectionMatrix * modelViewMatrix;
+	uniforms.normalMatrix = inverse(transpose(modelViewMatrix));
+
+	// The camera rarely moves while optimizing, so this is mostly skipped
+	if(memcmp(&uniforms, &uploadedSceneUniforms, sizeof(SceneUniforms)) != 0)
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, sceneUniformBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(SceneUniforms), &uniforms);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		uploadedSceneUniforms = uniforms;
+	}
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, sceneUniformBuffer);
 
-	// camera
-	labhelper::setUniformSlow(currentShaderProgram, "viewInverse", inverse(viewMatrix));
-    
-	mat4 modelMatrix = glm::translate(vec3(0.0f, 0.0f, -7.0f)); 
     // Render the specified model
-    labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-                              projectionMatrix * viewMatrix * modelMatrix * mat4(1.0f));
-    labhelper::render(modelToRender);
+	labhelper::render(shaders, modelToRender, true, numInstances);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+/// Renders the positively and negatively perturbed spheres to their FBOs. Both
+/// use the same clear color, since the background is part of the pixel error.
+///////////////////////////////////////////////////////////////////////////////
+void renderPerturbed(const mat4& viewMatrix, const mat4& projMatrix)
+{
+	// The pixel error needs the filled coverage
+	labhelper::setRenderMode(labhelper::RenderMode::Fill);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render to FBO 1 (original perturbed sphere)
+	///////////////////////////////////////////////////////////////////////////
+	glBindFramebuffer(GL_FRAMEBUFFER, posPerturbedFBO->framebufferId);
+	glViewport(0, 0, windowWidth, windowHeight);
+	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	drawScene(shadingShaders, viewMatrix, projMatrix, sphereModel);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render to FBO 2 (oppositely perturbed sphere)
+	///////////////////////////////////////////////////////////////////////////
+	glBindFramebuffer(GL_FRAMEBUFFER, negPerturbedFBO->framebufferId);
+	glViewport(0, 0, windowWidth, windowHeight);
+	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	drawScene(shadingShaders, viewMatrix, projMatrix, sphereModelPerturbedOpposite);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Renders both perturbations of every active pair with one instanced draw,
+/// each into its own layer of batchedPerturbedFBO
+///////////////////////////////////////////////////////////////////////////////
+void renderPerturbedLayered(const mat4& viewMatrix, const mat4& projMatrix)
+{
+	labhelper::setRenderMode(labhelper::RenderMode::Fill);
+	glBindFramebuffer(GL_FRAMEBUFFER, batchedPerturbedFBO->framebufferId);
+	glViewport(0, 0, windowWidth, windowHeight);
+	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	for(GLuint program : labhelper::getShaderVariants(batchedShaders, sphereModel))
+	{
+		glUseProgram(program);
+		glUniform1ui(labhelper::getUniformLocation(program, "numVertices"), GLuint(sphereModel->m_positions.size()));
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, perturbedOutputSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, perturbedOppositeOutputSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, perturbedNormalSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, perturbedOppositeNormalSSBO);
+	// Only made the first time each number of pairs is used
+	labhelper::prepareDrawCommands(sphereModel, 2 * activePerturbationPairs());
+	drawScene(batchedShaders, viewMatrix, projMatrix, sphereModel, 2 * activePerturbationPairs());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Draws the edges of a model on top of whatever is in the framebuffer
+///////////////////////////////////////////////////////////////////////////////
+void drawWireframeOverlay(const mat4& viewMatrix, const mat4& projMatrix, labhelper::Model* model)
+{
+	mat4 modelViewProjectionMatrix = projMatrix * viewMatrix * glm::translate(vec3(0.0f, 0.0f, -7.0f));
+	glUseProgram(simpleShaderProgram);
+	glUniformMatrix4fv(labhelper::getUniformLocation(simpleShaderProgram, "modelViewProjectionMatrix"), 1, false,
+	                   &modelViewProjectionMatrix[0].x);
+	glUniform3f(labhelper::getUniformLocation(simpleShaderProgram, "material_color"), 1.0f, 1.0f, 1.0f);
+	labhelper::setRenderMode(labhelper::RenderMode::Wireframe);
+	labhelper::render(simpleShaderProgram, model, false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Computes the mean squared error of both perturbed renders of every pair
+/// against the input image. Each work group reduces its pixels in shared
+/// memory, and a second pass reduces the group sums of each pair into the two
+/// scalars in errorSSBO.
+///////////////////////////////////////////////////////////////////////////////
+void computePixelError()
+{
+	ivec2 numGroups = pixelErrorGroupCount();
+	int numSamples = activePerturbationPairs();
+
+	if(layeredPerturbation())
+	{
+		glUseProgram(batchedPixelErrorShaderProgram);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, batchedPerturbedFBO->colorTextureTargets[0]);
+	}
+	else
+	{
+		glUseProgram(pixelErrorShaderProgram);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, posPerturbedFBO->colorTextureTargets[0]);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, negPerturbedFBO->colorTextureTargets[0]);
+	}
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, inputImageFBO->colorTextureTargets[0]);
+	glActiveTexture(GL_TEXTURE0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, groupErrorSSBO);
+
+	GLuint program = layeredPerturbation() ? batchedPixelErrorShaderProgram : pixelErrorShaderProgram;
+	labhelper::dispatchCompute(program, uvec3(windowWidth, windowHeight, numSamples));
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// One work group per sample, each looping over all group sums of its sample
+	glUseProgram(reduceErrorShaderProgram);
+	glUniform1ui(glGetUniformLocation(reduceErrorShaderProgram, "numGroups"), numGroups.x * numGroups.y);
+	glUniform1f(glGetUniformLocation(reduceErrorShaderProgram, "errorScale"),
+	            1.0f / float(windowWidth * windowHeight));
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, groupErrorSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, errorSSBO);
+
+	uvec3 reduceGroupSize = labhelper::getComputeWorkGroupSize(reduceErrorShaderProgram);
+	labhelper::dispatchCompute(reduceErrorShaderProgram, uvec3(numSamples * reduceGroupSize.x, 1, 1));
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Moves the vertices against the finite difference gradient estimate, into
+/// the next parameter buffer of the ring
+///////////////////////////////////////////////////////////////////////////////
+void updateVertices()
+{
+	int nextParameterState = (currentParameterState + 1) % parameterHistorySize;
+
+	glUseProgram(updateShaderProgram);
+	glUniform1ui(glGetUniformLocation(updateShaderProgram, "iteration"), iteration);
+	glUniform1f(glGetUniformLocation(updateShaderProgram, "perturbMag"), perturbMag);
+	glUniform1f(glGetUniformLocation(updateShaderProgram, "learningRate"), learningRate);
+	glUniform1ui(glGetUniformLocation(updateShaderProgram, "numSamples"), activePerturbationPairs());
+
+	size_t numParameters = sphereModel->m_welded_positions.size();
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, parameterSSBOs[currentParameterState]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, errorSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, parameterSSBOs[nextParameterState]);
+
+	labhelper::dispatchCompute(updateShaderProgram, uvec3(numParameters, 1, 1));
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	currentParameterState = nextParameterState;
+	numRollbackStates = std::min(numRollbackStates + 1, parameterHistorySize - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Goes back numSteps optimization steps, as far as the parameter ring
+/// reaches. Returns the number of steps actually rolled back.
+///////////////////////////////////////////////////////////////////////////////
+int rollbackParameters(int numSteps)
+{
+	numSteps = std::min(numSteps, numRollbackStates);
+	currentParameterState = (currentParameterState - numSteps + parameterHistorySize) % parameterHistorySize;
+	numRollbackStates -= numSteps;
+	return numSteps;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// One iteration of the optimizer: perturb the vertices in a random direction,
+/// render both perturbations, measure their error against the input image and
+/// step the vertices along the antithetic finite difference gradient.
+///////////////////////////////////////////////////////////////////////////////
+void optimizationStep()
+{
+	mat4 projMatrix = perspective(radians(45.0f), float(windowWidth) / float(windowHeight), 5.0f, 2000.0f);
+	mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
+
+	perturbVertices();
+	if(layeredPerturbation())
+	{
+		renderPerturbedLayered(viewMatrix, projMatrix);
+	}
+	else
+	{
+		renderPerturbed(viewMatrix, projMatrix);
+	}
+	computePixelError();
+	updateVertices();
+	iteration++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Runs the optimization iterations of one frame. With a time budget at most
+/// one iteration is kept in flight, so that the CPU side timing follows the
+/// GPU instead of just queueing up commands. Returns the number of iterations.
+///////////////////////////////////////////////////////////////////////////////
+int runScheduledIterations()
+{
+	if(!useIterationTimeBudget)
+	{
+		for(int i = 0; i < iterationsPerFrame; i++)
+		{
+			optimizationStep();
+		}
+		return iterationsPerFrame;
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+	std::chrono::duration<float, std::milli> elapsed(0.0f);
+	GLsync previousFence = nullptr;
+	int numIterations = 0;
+	do
+	{
+		optimizationStep();
+		numIterations++;
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		if(previousFence != nullptr)
+		{
+			glClientWaitSync(previousFence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(previousFence);
+		}
+		previousFence = fence;
+		elapsed = std::chrono::steady_clock::now() - startTime;
+	} while(elapsed.count() < iterationTimeBudgetMs);
+	glDeleteSync(previousFence);
+	return numIterations;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Renders the loaded image to inputImageFBO, to match the FBO resolution
+///////////////////////////////////////////////////////////////////////////////
+void renderInputImage()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, inputImageFBO->framebufferId);
+	glViewport(0, 0, windowWidth, windowHeight);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// The previous frame may have ended with the wireframe overlay
+	labhelper::setRenderMode(labhelper::RenderMode::Fill);
+	glUseProgram(fullScreenQuadShaderProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, loadedImageTempTextureId);
+	labhelper::setUniformSlow(fullScreenQuadShaderProgram, "colorTexture", 0);
+	labhelper::drawFullScreenQuad();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Resizes all FBOs and the buffers that depend on their size, and renders the
+/// input image at the new resolution
+///////////////////////////////////////////////////////////////////////////////
+void resizeFramebuffers(int w, int h)
+{
+	windowWidth = w;
+	windowHeight = h;
+	posPerturbedFBO->resize(windowWidth, windowHeight);
+	negPerturbedFBO->resize(windowWidth, windowHeight);
+	inputImageFBO->resize(windowWidth, windowHeight);
+	batchedPerturbedFBO->resize(windowWidth, windowHeight);
+	allocateGroupErrorBuffer();
+	renderInputImage();
 }
 
 
@@ -324,11 +834,7 @@ void display(void)
 		SDL_GetWindowSize(g_window, &w, &h);
 		if(w != windowWidth || h != windowHeight)
 		{
-			windowWidth = w;
-			windowHeight = h;
-            posPerturbedFBO->resize(windowWidth, windowHeight);
-            negPerturbedFBO->resize(windowWidth, windowHeight);
-            inputImageFBO->resize(windowWidth, windowHeight);
+			resizeFramebuffers(w, h);
 		}
 	}
 
@@ -339,36 +845,10 @@ void display(void)
 	mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
 
 	///////////////////////////////////////////////////////////////////////////
-	// Render to FBO 1 (original perturbed sphere)
+	// Render the perturbed spheres to FBO 1 and 2. The input image in FBO 3
+	// only changes when the window is resized.
 	///////////////////////////////////////////////////////////////////////////
-    glBindFramebuffer(GL_FRAMEBUFFER, posPerturbedFBO->framebufferId);
-    glViewport(0, 0, windowWidth, windowHeight);
-    glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    drawScene(shaderProgram, viewMatrix, projMatrix, sphereModel);
-
-    ///////////////////////////////////////////////////////////////////////////
-    // Render to FBO 2 (oppositely perturbed sphere)
-    ///////////////////////////////////////////////////////////////////////////
-    glBindFramebuffer(GL_FRAMEBUFFER, negPerturbedFBO->framebufferId);
-    glViewport(0, 0, windowWidth, windowHeight);
-    glClearColor(0.8f, 0.2f, 0.2f, 1.0f); // Different clear color to distinguish
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    drawScene(shaderProgram, viewMatrix, projMatrix, sphereModelPerturbedOpposite);
-
-    ///////////////////////////////////////////////////////////////////////////
-    // Render loaded image to FBO 3 (to match resolution)
-    ///////////////////////////////////////////////////////////////////////////
-    glBindFramebuffer(GL_FRAMEBUFFER, inputImageFBO->framebufferId);
-    glViewport(0, 0, windowWidth, windowHeight);
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    glUseProgram(fullScreenQuadShaderProgram);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, loadedImageTempTextureId);
-    labhelper::setUniformSlow(fullScreenQuadShaderProgram, "colorTexture", 0);
-    labhelper::drawFullScreenQuad();
+	renderPerturbed(viewMatrix, projMatrix);
 
 
 	///////////////////////////////////////////////////////////////////////////
@@ -379,6 +859,7 @@ void display(void)
 	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	labhelper::setRenderMode(labhelper::RenderMode::Fill);
     glUseProgram(fullScreenQuadShaderProgram);
     glActiveTexture(GL_TEXTURE0);
 
@@ -392,6 +873,11 @@ void display(void)
     labhelper::setUniformSlow(fullScreenQuadShaderProgram, "colorTexture", 0);
     labhelper::drawFullScreenQuad();
 
+	if(showWireframeOverlay && !renderImageTexture)
+	{
+		drawWireframeOverlay(viewMatrix, projMatrix,
+		                     renderOriginalPerturbed ? sphereModel : sphereModelPerturbedOpposite);
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -510,9 +996,39 @@ void gui()
     ImGui::Text("Press 'P' to toggle between perturbed spheres.");
 	ImGui::Text("Press 'I' to render Image Texture.");
 	ImGui::Text("Press 'R' to reset peturb count.");
-	ImGui::SliderFloat("perturbMag", &perturbMag, 0.0f, 1.0f);
+	ImGui::SliderFloat("perturbMag", &perturbMag, 1e-4f, 1.0f);
+	ImGui::SliderFloat("learningRate", &learningRate, 0.0f, 10.0f);
 	ImGui::Checkbox("Perturb on", &perturb);
 	ImGui::Checkbox("Perturb only once", &perturbOnce);
+	ImGui::Text("%.1f iterations/s", iterationsPerSecond);
+	ImGui::Checkbox("Use time budget", &useIterationTimeBudget);
+	if(useIterationTimeBudget)
+	{
+		ImGui::SliderFloat("Time budget (ms/frame)", &iterationTimeBudgetMs, 1.0f, 100.0f);
+	}
+	else
+	{
+		ImGui::SliderInt("Iterations per frame", &iterationsPerFrame, 1, 100);
+	}
+	ImGui::SliderInt("Preview every Nth frame", &previewInterval, 1, 60);
+	if(layeredPerturbationSupported)
+	{
+		ImGui::Checkbox("Single pass perturbation", &singlePassPerturbation);
+		ImGui::Checkbox("Batched perturbation", &batchedPerturbation);
+	}
+	ImGui::Checkbox("Wireframe overlay", &showWireframeOverlay);
+	ImGui::Text("%d previous steps stored", numRollbackStates);
+	if(ImGui::Button("Undo step"))
+	{
+		rollbackParameters(1);
+	}
+	if(ImGui::SliderInt("Perturbation pairs", &numPerturbationPairs, 1, maxPerturbationPairs))
+	{
+		allocatePerturbationBuffers();
+		allocateGroupErrorBuffer();
+		batchedPerturbedFBO->numLayers = 2 * numPerturbationPairs;
+		batchedPerturbedFBO->resize(windowWidth, windowHeight);
+	}
 	// ----------------------------------------------------------
 
 
@@ -522,14 +1038,165 @@ void gui()
 	labhelper::perf::drawEventsWindow();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Frees everything allocated by initialize()
+///////////////////////////////////////////////////////////////////////////////
+void cleanup()
+{
+	// Free Models
+	// Instances before the model they share their buffers with
+	labhelper::freeModel(sphereModelPerturbedOpposite);
+	labhelper::freeModel(sphereModel);
+
+    // Delete FBOs
+    delete posPerturbedFBO;
+    delete negPerturbedFBO;
+    delete inputImageFBO;
+    delete batchedPerturbedFBO;
+
+    glDeleteTextures(1, &loadedImageTempTextureId);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Runs the optimizer without a window, as fast as the device allows, and
+/// optionally writes the optimized sphere to an OBJ file
+///////////////////////////////////////////////////////////////////////////////
+int runHeadless(int numIterations, int width, int height, const std::string& outputFilename, bool debugGL)
+{
+	if(!labhelper::init_headless_EGL(debugGL))
+	{
+		return 1;
+	}
+
+	initialize();
+	resizeFramebuffers(width, height);
+
+	auto startTime = std::chrono::steady_clock::now();
+	for(int i = 0; i < numIterations; i++)
+	{
+		optimizationStep();
+	}
+	glFinish();
+	std::chrono::duration<float> runTime = std::chrono::steady_clock::now() - startTime;
+
+	// Error of the last perturbation pair of the final iteration
+	vec2 error;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, errorSSBO);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, (activePerturbationPairs() - 1) * sizeof(vec2), sizeof(vec2), &error);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	printf("%d iterations in %.3f s (%.1f iterations/s), final error %f / %f\n", numIterations,
+	       runTime.count(), numIterations / runTime.count(), error.x, error.y);
+
+	if(!outputFilename.empty())
+	{
+		std::vector<vec3>& parameters = sphereModel->m_welded_positions;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, parameterSSBOs[currentParameterState]);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, parameters.size() * sizeof(vec3), parameters.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		for(size_t i = 0; i < sphereModel->m_positions.size(); i++)
+		{
+			sphereModel->m_positions[i] = parameters[sphereModel->m_welded_position_indices[i]];
+		}
+		// The normals of the final positions, rather than the last perturbed ones
+		size_t positionsSize = sphereModel->m_positions.size() * sizeof(vec3);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedOutputSSBO);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, positionsSize, sphereModel->m_positions.data());
+		recomputeNormals();
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, perturbedNormalSSBO);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, positionsSize, sphereModel->m_normals.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		labhelper::saveModelToOBJ(sphereModel, outputFilename);
+	}
+
+	cleanup();
+	labhelper::shutDownHeadless();
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
+	///////////////////////////////////////////////////////////////////////////
+	// Command line options:
+	//   --headless           optimize without a window (needs EGL)
+	//   --iterations N       number of iterations to run headless
+	//   --size W H           resolution of the renders when headless
+	//   --batched K          evaluate K perturbation pairs per iteration
+	//   --history N          keep the last N - 1 optimization steps for undo
+	//   --output file.obj    save the optimized sphere when headless
+	//   --debug-gl           use a debug context when headless, reporting GL
+	//                        errors as they happen (slow)
+	//   --shader-cache dir   where to keep compiled shader programs, "" for
+	//                        nowhere (default shader_cache)
+	///////////////////////////////////////////////////////////////////////////
+	bool headless = false;
+	int numIterations = 1000;
+	int width = 1280, height = 720;
+	std::string outputFilename;
+	bool debugGL = false;
+	std::string shaderCacheDirectory = "shader_cache";
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if(arg == "--headless")
+		{
+			headless = true;
+		}
+		else if(arg == "--iterations" && i + 1 < argc)
+		{
+			numIterations = std::max(0, atoi(argv[++i]));
+		}
+		else if(arg == "--size" && i + 2 < argc)
+		{
+			width = std::max(1, atoi(argv[++i]));
+			height = std::max(1, atoi(argv[++i]));
+		}
+		else if(arg == "--batched" && i + 1 < argc)
+		{
+			batchedPerturbation = true;
+			numPerturbationPairs = clamp(atoi(argv[++i]), 1, maxPerturbationPairs);
+		}
+		else if(arg == "--history" && i + 1 < argc)
+		{
+			parameterHistorySize = clamp(atoi(argv[++i]), 2, maxParameterHistorySize);
+		}
+		else if(arg == "--output" && i + 1 < argc)
+		{
+			outputFilename = argv[++i];
+		}
+		else if(arg == "--debug-gl")
+		{
+			debugGL = true;
+		}
+		else if(arg == "--shader-cache" && i + 1 < argc)
+		{
+			shaderCacheDirectory = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "Unknown or incomplete argument: %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	// Compiling the shaders dominates the startup time of short runs
+	labhelper::setProgramBinaryCacheDirectory(shaderCacheDirectory);
+
+	if(headless)
+	{
+		return runHeadless(numIterations, width, height, outputFilename, debugGL);
+	}
+
 	g_window = labhelper::init_window_SDL("OpenGL Project");
 
 	initialize();
 
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
+	int frameCount = 0;
+	int iterationsSinceMeasure = 0;
+	float lastMeasureTime = 0.0f;
 
 	while(!stopRendering)
 	{
@@ -542,23 +1209,37 @@ int main(int argc, char* argv[])
 		// check events (keyboard among other)
 		stopRendering = handleEvents();
 
-		// Inform imgui of new frame
-		labhelper::newFrame( g_window );
-
-		// if (count == 100) perturbVertices();
-		// count++;
-
 		if (perturb) {
+			labhelper::perf::Scope s( "Optimization step" );
 			if (perturbOnce) {
 				if (!hasBeenPerturbed) {
-					perturbVertices();
+					optimizationStep();
+					iterationsSinceMeasure++;
 					hasBeenPerturbed = true;
 				}
 			}
 			else {
-				perturbVertices();
+				iterationsSinceMeasure += runScheduledIterations();
 			}
 		}
+		if(currentTime - lastMeasureTime >= 1.0f)
+		{
+			iterationsPerSecond = iterationsSinceMeasure / (currentTime - lastMeasureTime);
+			iterationsSinceMeasure = 0;
+			lastMeasureTime = currentTime;
+		}
+
+		// While optimizing, only present every previewInterval:th frame and let
+		// the others just optimize
+		bool optimizing = perturb && !perturbOnce;
+		if(optimizing && frameCount++ % previewInterval != 0)
+		{
+			continue;
+		}
+
+		// Inform imgui of new frame
+		labhelper::newFrame( g_window );
+
 		// render to window
 		display();
 
@@ -571,16 +1252,7 @@ int main(int argc, char* argv[])
 		// Swap front and back buffer. This frame will now been displayed.
 		SDL_GL_SwapWindow(g_window);
 	}
-	// Free Models
-	labhelper::freeModel(sphereModel);
-    labhelper::freeModel(sphereModelPerturbedOpposite);
-
-    // Delete FBOs
-    delete posPerturbedFBO;
-    delete negPerturbedFBO;
-    delete inputImageFBO;
-
-    glDeleteTextures(1, &loadedImageTempTextureId);
+	cleanup();
 
 	// Shut down everything. This includes the window and all other subsystems.
 	labhelper::shutDown(g_window);
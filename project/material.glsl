@@ -0,0 +1,51 @@
+///////////////////////////////////////////////////////////////////////////////
+// The materials of the model being drawn, uploaded by labhelper when the model
+// is loaded (see GpuMaterial in Model.cpp, std430). labhelper::render draws
+// each mesh with its material index as the base instance, which the vertex
+// shader passes on in materialIndex (see material_index.glsl). Without
+// ARB_shader_draw_parameters, render() instead sets the material_index
+// uniform per mesh. The macros below keep the old names of the per material
+// uniforms.
+///////////////////////////////////////////////////////////////////////////////
+#define COLOR_TEXTURE_BIT 1u
+#define REFLECTIVITY_TEXTURE_BIT 2u
+#define SHININESS_TEXTURE_BIT 4u
+#define METALNESS_TEXTURE_BIT 8u
+#define FRESNEL_TEXTURE_BIT 16u
+#define EMISSION_TEXTURE_BIT 32u
+
+struct Material
+{
+	vec3 color;
+	float reflectivity;
+	float metalness;
+	float fresnel;
+	float shininess;
+	float emission;
+	uint texture_mask;
+};
+
+layout(std430, binding = 7) readonly buffer MaterialBuffer
+{
+	Material materials[];
+};
+
+#ifdef GL_ARB_shader_draw_parameters
+flat in uint materialIndex;
+#define material_index materialIndex
+#else
+uniform uint material_index;
+#endif
+
+#define material_color (materials[material_index].color)
+#define material_reflectivity (materials[material_index].reflectivity)
+#define material_metalness (materials[material_index].metalness)
+#define material_fresnel (materials[material_index].fresnel)
+#define material_shininess (materials[material_index].shininess)
+#define material_emission (materials[material_index].emission)
+
+// Shaders loaded as labhelper::ShaderPermutations rather check the
+// HAS_*_TEXTURE defines of their variant, which avoids the branch
+#define has_texture(bit) ((materials[material_index].texture_mask & (bit)) != 0u)
+#define has_color_texture has_texture(COLOR_TEXTURE_BIT)
+#define has_emission_texture has_texture(EMISSION_TEXTURE_BIT)
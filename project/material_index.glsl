@@ -0,0 +1,13 @@
+///////////////////////////////////////////////////////////////////////////////
+// Vertex shader side of material.glsl. labhelper::render draws every mesh with
+// its material index as the base instance, so all meshes of a model can be
+// drawn with one glMultiDrawElementsIndirect. The including shader has to
+// enable GL_ARB_shader_draw_parameters before its first declaration, and call
+// passMaterialIndex() from main().
+///////////////////////////////////////////////////////////////////////////////
+#ifdef GL_ARB_shader_draw_parameters
+flat out uint materialIndex;
+#define passMaterialIndex() materialIndex = uint(gl_BaseInstanceARB)
+#else
+#define passMaterialIndex()
+#endif
@@ -0,0 +1,20 @@
+///////////////////////////////////////////////////////////////////////////////
+// Vertex positions (and perturbation directions and normals) are stored
+// tightly packed, three floats per vertex, exactly like std::vector<vec3> on
+// the C++ side and like the vertex attributes reading them. A vec3 array in a
+// std430 block would instead have a 16 byte stride. Declare the buffers as
+// float arrays and access them through these macros.
+///////////////////////////////////////////////////////////////////////////////
+#define PACKED_POSITION_COUNT(buffer) (uint(buffer.length()) / 3u)
+
+#define LOAD_PACKED_POSITION(buffer, index) \
+	vec3(buffer[3u * (index)], buffer[3u * (index) + 1u], buffer[3u * (index) + 2u])
+
+#define STORE_PACKED_POSITION(buffer, index, value) \
+	{                                               \
+		uint i_ = 3u * (index);                     \
+		vec3 v_ = (value);                          \
+		buffer[i_] = v_.x;                          \
+		buffer[i_ + 1u] = v_.y;                     \
+		buffer[i_ + 2u] = v_.z;                     \
+	}
@@ -0,0 +1,41 @@
+///////////////////////////////////////////////////////////////////////////////
+// The random perturbation direction of a parameter (welded vertex position).
+// It only depends on the parameter, the sample and the iteration, so
+// perturb.comp and update.comp can both generate it and it never has to be
+// stored.
+///////////////////////////////////////////////////////////////////////////////
+
+// Psuedo-random generator courtesy of https://stackoverflow.com/a/17479300
+// A single iteration of Bob Jenkins' One-At-A-Time hashing algorithm.
+uint hash( uint x ) {
+    x += ( x << 10u );
+    x ^= ( x >>  6u );
+    x += ( x <<  3u );
+    x ^= ( x >> 11u );
+    x += ( x << 15u );
+    return x;
+}
+
+// Construct a float with half-open range [0:1] using low 23 bits.
+// All zeroes yields 0.0, all ones yields the next smallest representable value below 1.0.
+float floatConstruct( uint m ) {
+    const uint ieeeMantissa = 0x007FFFFFu; // binary32 mantissa bitmask
+    const uint ieeeOne      = 0x3F800000u; // 1.0 in IEEE binary32
+
+    m &= ieeeMantissa;                     // Keep only mantissa bits (fractional part)
+    m |= ieeeOne;                          // Add fractional part to 1.0
+
+    float  f = uintBitsToFloat( m );       // Range [1:2]
+    return f - 1.5;                        // Range [-0.5:0.5]
+}
+
+// Pseudo-random value in half-open range [-0.5:0.5].
+float random( uint x ) { return floatConstruct(hash(x)); }
+
+// Each sample gets its own direction by offsetting the seed. Seeded by the
+// iteration count rather than the time, so iterations that run faster than the
+// clock resolution still get distinct directions.
+vec3 perturbDirection( uint parameter, uint sampleIndex, uint iteration ) {
+    uint seed = hash(parameter + hash(iteration)) + 3u * sampleIndex;
+    return vec3(random(seed), random(seed + 1u), random(seed + 2u));
+}
@@ -0,0 +1,89 @@
+#version 430
+#extension GL_ARB_shader_viewport_layer_array : enable
+#extension GL_AMD_vertex_shader_layer : enable
+#extension GL_ARB_shader_draw_parameters : enable
+#include "packed_positions.glsl"
+#if defined(GL_ARB_shader_viewport_layer_array) || defined(GL_AMD_vertex_shader_layer)
+#define VERTEX_SHADER_LAYER
+#endif
+///////////////////////////////////////////////////////////////////////////////
+// Renders all perturbations of a batch with one instanced draw. Instance 2k
+// is the positive and instance 2k + 1 the negative perturbation of sample k,
+// and each instance is routed to the framebuffer layer of the same index.
+// Without either layer extension the vertex shader can't select the layer, and
+// perturbed_layer.geom does it instead.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Input vertex attributes, positions and normals come from the perturbation
+// buffers
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 2) in vec2 texCoordIn;
+
+layout(std430, binding = 0) buffer PerturbedOutputBuffer {
+	float perturbedPositions[];
+};
+
+layout(std430, binding = 1) buffer PerturbedOppositeOutputBuffer {
+	float perturbedOppositePositions[];
+};
+
+layout(std430, binding = 2) buffer PerturbedNormalBuffer {
+	float perturbedNormals[];
+};
+
+layout(std430, binding = 3) buffer PerturbedOppositeNormalBuffer {
+	float perturbedOppositeNormals[];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Input uniform variables
+///////////////////////////////////////////////////////////////////////////////
+#include "scene_uniforms.glsl"
+uniform uint numVertices;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output to fragment shader, or to perturbed_layer.geom along with the layer
+///////////////////////////////////////////////////////////////////////////////
+#ifdef VERTEX_SHADER_LAYER
+out vec2 texCoord;
+out vec3 viewSpaceNormal;
+out vec3 viewSpacePosition;
+#include "material_index.glsl"
+#else
+out PerturbedVertex
+{
+	vec2 texCoord;
+	vec3 viewSpaceNormal;
+	vec3 viewSpacePosition;
+	flat int layer;
+#ifdef GL_ARB_shader_draw_parameters
+	flat uint materialIndex;
+#endif
+};
+#define passMaterialIndex() materialIndex = uint(gl_BaseInstanceARB)
+#endif
+
+
+void main()
+{
+	uint sampleIndex = uint(gl_InstanceID) / 2u;
+	uint index = sampleIndex * numVertices + uint(gl_VertexID);
+	vec3 position = (gl_InstanceID % 2 == 0) ? LOAD_PACKED_POSITION(perturbedPositions, index)
+	                                         : LOAD_PACKED_POSITION(perturbedOppositePositions, index);
+	vec3 normalIn = (gl_InstanceID % 2 == 0) ? LOAD_PACKED_POSITION(perturbedNormals, index)
+	                                         : LOAD_PACKED_POSITION(perturbedOppositeNormals, index);
+
+#ifdef GL_ARB_shader_draw_parameters
+	passMaterialIndex();
+#endif
+#ifdef VERTEX_SHADER_LAYER
+	gl_Layer = gl_InstanceID;
+#else
+	layer = gl_InstanceID;
+#endif
+	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+	texCoord = texCoordIn;
+	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
+	viewSpacePosition = (modelViewMatrix * vec4(position, 1.0)).xyz;
+}
@@ -0,0 +1,16 @@
+///////////////////////////////////////////////////////////////////////////////
+// Camera and light source, set once per draw of the scene rather than as
+// separate uniforms. Mirrors SceneUniforms in main.cpp (std140).
+///////////////////////////////////////////////////////////////////////////////
+layout(std140, binding = 0) uniform SceneUniforms
+{
+	mat4 viewInverse;
+	mat4 modelViewMatrix;
+	mat4 modelViewProjectionMatrix;
+	mat4 normalMatrix;
+	vec3 viewSpaceLightPosition;
+	float point_light_intensity_multiplier;
+	vec3 viewSpaceLightDir;
+	float environment_multiplier;
+	vec3 point_light_color;
+};
@@ -1,4 +1,4 @@
-#version 420
+#version 430
 
 // required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
 precision highp float;
@@ -6,15 +6,7 @@ precision highp float;
 ///////////////////////////////////////////////////////////////////////////////
 // Material
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 material_color;
-uniform float material_reflectivity;
-uniform float material_metalness;
-uniform float material_fresnel;
-uniform float material_shininess;
-uniform float material_emission;
-
-uniform int has_emission_texture;
-uniform int has_color_texture;
+#include "material.glsl"
 layout(binding = 0) uniform sampler2D colorMap;
 layout(binding = 5) uniform sampler2D emissiveMap;
 
@@ -24,13 +16,11 @@ layout(binding = 5) uniform sampler2D emissiveMap;
 layout(binding = 6) uniform sampler2D environmentMap;
 layout(binding = 7) uniform sampler2D irradianceMap;
 layout(binding = 8) uniform sampler2D reflectionMap;
-uniform float environment_multiplier;
 
 ///////////////////////////////////////////////////////////////////////////////
-// Light source
+// Environment multiplier, light source and camera
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 point_light_color = vec3(1.0, 1.0, 1.0);
-uniform float point_light_intensity_multiplier = 50.0;
+#include "scene_uniforms.glsl"
 
 ///////////////////////////////////////////////////////////////////////////////
 // Constants
@@ -44,12 +34,6 @@ in vec2 texCoord;
 in vec3 viewSpaceNormal;
 in vec3 viewSpacePosition;
 
-///////////////////////////////////////////////////////////////////////////////
-// Input uniform variables
-///////////////////////////////////////////////////////////////////////////////
-uniform mat4 viewInverse;
-uniform vec3 viewSpaceLightPosition;
-
 ///////////////////////////////////////////////////////////////////////////////
 // Output color
 ///////////////////////////////////////////////////////////////////////////////
@@ -82,13 +66,13 @@ void main()
 	vec3 indirect_illumination_term = calculateIndirectIllumination(wo, n);
 
 	///////////////////////////////////////////////////////////////////////////
-	// Add emissive term. If emissive texture exists, sample this term.
+	// Add emissive term. If emissive texture exists, sample this term. Which
+	// is known at compile time, see shadingFeatureDefines in main.cpp.
 	///////////////////////////////////////////////////////////////////////////
 	vec3 emission_term = material_emission * material_color;
-	if(has_emission_texture == 1)
-	{
-		emission_term = texture(emissiveMap, texCoord).xyz;
-	}
+#ifdef HAS_EMISSION_TEXTURE
+	emission_term = texture(emissiveMap, texCoord).xyz;
+#endif
 
 	vec3 shading = direct_illumination_term + indirect_illumination_term + emission_term;
 
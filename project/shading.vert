@@ -1,17 +1,18 @@
 #version 420
+#extension GL_ARB_shader_draw_parameters : enable
 ///////////////////////////////////////////////////////////////////////////////
 // Input vertex attributes
 ///////////////////////////////////////////////////////////////////////////////
 layout(location = 0) in vec3 position;
+// Octahedral encoded in xy if octahedral_normals is set (compact models)
 layout(location = 1) in vec3 normalIn;
 layout(location = 2) in vec2 texCoordIn;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
 ///////////////////////////////////////////////////////////////////////////////
-uniform mat4 normalMatrix;
-uniform mat4 modelViewMatrix;
-uniform mat4 modelViewProjectionMatrix;
+#include "scene_uniforms.glsl"
+uniform bool octahedral_normals = false;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
@@ -19,13 +20,25 @@ uniform mat4 modelViewProjectionMatrix;
 out vec2 texCoord;
 out vec3 viewSpaceNormal;
 out vec3 viewSpacePosition;
+#include "material_index.glsl"
 
+vec3 decodeOctahedral(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if(n.z < 0.0)
+	{
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(n);
+}
 
 void main()
 {
+	vec3 normal = octahedral_normals ? decodeOctahedral(normalIn.xy) : normalIn;
+	passMaterialIndex();
 	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
 	texCoord = texCoordIn;
-	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
+	viewSpaceNormal = (normalMatrix * vec4(normal, 0.0)).xyz;
 	viewSpacePosition = (modelViewMatrix * vec4(position, 1.0)).xyz;
 
 }